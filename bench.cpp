@@ -0,0 +1,428 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/* Rough timings of apathy's bulk operations against the naive ways of doing
+ * the same thing. Everything happens in a scratch directory, bench-scratch,
+ * under the current working directory. */
+
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <iostream>
+
+/* Internal libraries */
+#include "path.hpp"
+#include "pathlist.hpp"
+#include "sort.hpp"
+
+using namespace apathy;
+
+/* Where all the benchmarks do their work */
+const Path scratch("bench-scratch");
+
+/* Run f once and return how many seconds it took */
+template <class F>
+double timed(F f) {
+    std::chrono::steady_clock::time_point start(
+        std::chrono::steady_clock::now());
+    f();
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+/* Print a single timing, relative to a baseline timing */
+void report(const std::string& name, double seconds, double baseline) {
+    std::cout << "    " << std::left << std::setw(36) << name
+              << std::right << std::fixed << std::setprecision(4)
+              << std::setw(10) << seconds << "s"
+              << std::setprecision(2) << std::setw(8)
+              << (seconds > 0 ? baseline / seconds : 0) << "x" << std::endl;
+}
+
+/* The copy everyone writes first */
+bool stream_copy(const Path& source, const Path& dest) {
+    std::ifstream in(source.string().c_str(), std::ios::binary);
+    std::ofstream out(dest.string().c_str(), std::ios::binary);
+    out << in.rdbuf();
+    return in.good() && out.good();
+}
+
+void bench_copy() {
+    std::cout << "copy" << std::endl;
+
+    /* One large file */
+    Path big(Path(scratch).append("big"));
+    {
+        std::string block(1 << 20, 'x');
+        std::ofstream out(big.string().c_str(), std::ios::binary);
+        for (int i = 0; i < 256; ++i) {
+            out << block;
+        }
+    }
+
+    Path dest(Path(scratch).append("big-copy"));
+    double baseline = timed([&]() { stream_copy(big, dest); });
+    report("256MB ifstream/ofstream", baseline, baseline);
+    Path::rm(dest);
+    report("256MB Path::copy",
+        timed([&]() { Path::copy(big, dest); }), baseline);
+    Path::rm(dest);
+
+    /* A tree of many small files */
+    Path tree(Path(scratch).append("tree"));
+    for (int d = 0; d < 32; ++d) {
+        Path dir(Path(tree).append(d));
+        Path::makedirs(dir);
+        std::string contents(16 << 10, 'y');
+        for (int f = 0; f < 128; ++f) {
+            std::ofstream out(Path(dir).append(f).string().c_str());
+            out << contents;
+        }
+    }
+
+    Path copied(Path(scratch).append("tree-copy"));
+    baseline = timed([&]() {
+        std::vector<Path> dirs(Path::listdir(tree));
+        for (size_t d = 0; d < dirs.size(); ++d) {
+            Path dir(Path(copied).append(dirs[d].filename()));
+            Path::makedirs(dir);
+            std::vector<Path> files(Path::listdir(dirs[d]));
+            for (size_t f = 0; f < files.size(); ++f) {
+                stream_copy(files[f], Path(dir).append(files[f].filename()));
+            }
+        }
+    });
+    report("4096 files ifstream/ofstream", baseline, baseline);
+    Path::rmdirs(copied);
+    report("4096 files Path::copytree",
+        timed([&]() { Path::copytree(tree, copied); }), baseline);
+    Path::rmdirs(copied);
+    Path::rmdirs(tree);
+}
+
+/* The serial way of totalling up a tree */
+size_t naive_du(const Path& dir) {
+    size_t total = 0;
+    std::vector<Path> children(Path::listdir(dir));
+    for (size_t i = 0; i < children.size(); ++i) {
+        if (children[i].is_directory()) {
+            total += naive_du(children[i]);
+        } else {
+            total += children[i].size();
+        }
+    }
+    return total;
+}
+
+void bench_tree_stats() {
+    std::cout << "tree_stats" << std::endl;
+
+    Path tree(Path(scratch).append("tree"));
+    for (int a = 0; a < 16; ++a) {
+        for (int b = 0; b < 16; ++b) {
+            Path dir(Path(tree).append(a).append(b));
+            Path::makedirs(dir);
+            for (int f = 0; f < 64; ++f) {
+                Path::touch(Path(dir).append(f));
+            }
+        }
+    }
+
+    double baseline = timed([&]() { naive_du(tree); });
+    report("16k files listdir/size", baseline, baseline);
+    report("16k files Path::tree_stats",
+        timed([&]() { Path::tree_stats(tree); }), baseline);
+    Path::rmdirs(tree);
+}
+
+void bench_pathlist() {
+    std::cout << "pathlist" << std::endl;
+
+    std::vector<Path> paths;
+    for (int a = 0; a < 64; ++a) {
+        for (int b = 0; b < 64; ++b) {
+            for (int f = 0; f < 64; ++f) {
+                paths.push_back(Path("/srv/data/archive").append(a).append(
+                    b).append("file" + std::to_string(f) + ".dat"));
+            }
+        }
+    }
+
+    Path text(Path(scratch).append("paths.txt"));
+    Path list(Path(scratch).append("paths.list"));
+    std::ostringstream joined;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        joined << paths[i] << '\n';
+    }
+    Path::write_all(text, joined.str());
+    PathListWriter::save(list, paths);
+    std::cout << "    " << text.size() << " bytes as text, "
+              << list.size() << " as a path list" << std::endl;
+
+    double baseline = timed([&]() {
+        std::vector<Path> loaded;
+        std::ifstream in(text.string().c_str());
+        std::string line;
+        while (std::getline(in, line)) {
+            loaded.push_back(Path(line));
+        }
+    });
+    report("262k paths getline", baseline, baseline);
+    report("262k paths PathListReader::load", timed([&]() {
+        std::vector<Path> loaded;
+        PathListReader::load(list, loaded);
+    }), baseline);
+    report("262k paths PathListReader::next", timed([&]() {
+        PathListReader reader(list);
+        PathView view;
+        size_t total = 0;
+        while (reader.next(view)) {
+            total += view.size();
+        }
+    }), baseline);
+
+    Path::rm(text);
+    Path::rm(list);
+}
+
+void bench_sort() {
+    std::cout << "sort" << std::endl;
+
+    /* Many paths under a few long common prefixes, in scrambled order */
+    std::vector<Path> paths;
+    for (size_t i = 0; i < (1 << 20); ++i) {
+        size_t n = (i * 2654435761u) % (1 << 20);
+        paths.push_back(Path("/srv/data/archive").append(n % 64).append(
+            (n / 64) % 64).append("file" + std::to_string(n) + ".dat"));
+    }
+
+    std::vector<Path> sorted(paths);
+    double baseline = timed([&]() {
+        std::sort(sorted.begin(), sorted.end(),
+            [](const Path& a, const Path& b) {
+                return a.string() < b.string();
+            });
+    });
+    report("1M paths std::sort on string()", baseline, baseline);
+
+    sorted = paths;
+    report("1M paths std::sort with PathLess", timed([&]() {
+        std::sort(sorted.begin(), sorted.end(), PathLess());
+    }), baseline);
+
+    sorted = paths;
+    report("1M paths PathSort::sort, 1 thread",
+        timed([&]() { PathSort::sort(sorted, 1); }), baseline);
+
+    sorted = paths;
+    report("1M paths PathSort::sort",
+        timed([&]() { PathSort::sort(sorted); }), baseline);
+}
+
+void bench_segments() {
+    std::cout << "segments" << std::endl;
+
+    std::vector<Path> paths;
+    for (size_t i = 0; i < 100000; ++i) {
+        paths.push_back(Path("/srv/data/archive").append(i % 64).append(
+            (i / 64) % 64).append("file" + std::to_string(i) + ".dat"));
+    }
+
+    /* Each path is asked for every segment, its depth and its parent, as
+     * when laying out a tree */
+    size_t total = 0;
+    double baseline = timed([&]() {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            std::vector<Path::Segment> segments(paths[i].split());
+            for (size_t j = 0; j < segments.size(); ++j) {
+                total += segments[j].segment.size();
+            }
+            total += Path(paths[i]).up().string().size();
+        }
+    });
+    report("100k paths split()", baseline, baseline);
+
+    report("100k paths segment()", timed([&]() {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            size_t count = paths[i].segment_count();
+            for (size_t j = 0; j < count; ++j) {
+                total += paths[i].segment(j).size();
+            }
+            total += paths[i].parent().string().size();
+        }
+    }), baseline);
+
+    /* Once indexed, queries don't rescan the path at all */
+    report("100k paths segment(), indexed", timed([&]() {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            size_t count = paths[i].segment_count();
+            for (size_t j = 0; j < count; ++j) {
+                total += paths[i].segment(j).size();
+            }
+            total += paths[i].parent().string().size();
+        }
+    }), baseline);
+
+    /* Keep the work from being optimized away */
+    if (total == 0) {
+        std::cout << total << std::endl;
+    }
+}
+
+/* Finding a common prefix by comparing split() segments */
+Path naive_common_prefix(const std::vector<Path>& paths) {
+    std::vector<Path::Segment> prefix(paths[0].split());
+    for (size_t i = 1; i < paths.size(); ++i) {
+        std::vector<Path::Segment> segments(paths[i].split());
+        size_t common = 0;
+        while (common < prefix.size() && common < segments.size() &&
+            prefix[common].segment == segments[common].segment) {
+            ++common;
+        }
+        prefix.resize(common);
+    }
+    return Path::join(prefix);
+}
+
+void bench_common_prefix() {
+    std::cout << "common_prefix" << std::endl;
+
+    std::vector<Path> paths;
+    for (size_t i = 0; i < (1 << 20); ++i) {
+        paths.push_back(Path("/srv/data/archive").append(i % 64).append(
+            (i / 64) % 64).append("file" + std::to_string(i) + ".dat"));
+    }
+
+    double baseline = timed([&]() { naive_common_prefix(paths); });
+    report("1M paths split()", baseline, baseline);
+    report("1M paths common_prefix, 1 thread",
+        timed([&]() { Path::common_prefix(paths, 1); }), baseline);
+    report("1M paths common_prefix",
+        timed([&]() { Path::common_prefix(paths); }), baseline);
+
+    /* Relocating everything under a new root */
+    Path base("/srv/data/archive/7");
+    size_t total = 0;
+    baseline = timed([&]() {
+        std::vector<Path::Segment> prefix(base.split());
+        for (size_t i = 0; i < paths.size(); ++i) {
+            std::vector<Path::Segment> segments(paths[i].split());
+            size_t common = 0;
+            while (common < prefix.size() && common < segments.size() &&
+                prefix[common].segment == segments[common].segment) {
+                ++common;
+            }
+            std::vector<Path::Segment> relative(
+                prefix.size() - common, Path::Segment(".."));
+            relative.insert(relative.end(),
+                segments.begin() + common, segments.end());
+            total += Path::join(relative).string().size();
+        }
+    });
+    report("1M paths relative by split()", baseline, baseline);
+    report("1M paths Path::relative_to", timed([&]() {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            total += paths[i].relative_to(base).string().size();
+        }
+    }), baseline);
+
+    /* Keep the work from being optimized away */
+    if (total == 0) {
+        std::cout << total << std::endl;
+    }
+}
+
+void bench_create() {
+    std::cout << "create" << std::endl;
+
+    Path tree(Path(scratch).append("tree"));
+    std::vector<Path::FileSpec> files;
+    for (int a = 0; a < 16; ++a) {
+        for (int b = 0; b < 16; ++b) {
+            for (int f = 0; f < 64; ++f) {
+                files.push_back(Path::FileSpec(
+                    Path(tree).append(a).append(b).append(f)));
+            }
+        }
+    }
+
+    /* Removing a tree leaves the filesystem with writeback to do, which
+     * would otherwise land on whichever timing comes next */
+    ::sync();
+    double baseline = timed([&]() {
+        for (size_t i = 0; i < files.size(); ++i) {
+            Path::makedirs(files[i].path.parent());
+            Path::touch(files[i].path);
+        }
+    });
+    report("16k files makedirs/touch", baseline, baseline);
+    Path::rmdirs(tree);
+    ::sync();
+
+    report("16k files Path::create",
+        timed([&]() { Path::create(files); }), baseline);
+    Path::rmdirs(tree);
+    ::sync();
+
+    /* Preallocating is compared against doing the same one file at a time */
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i].size = 64 * 1024;
+    }
+    baseline = timed([&]() {
+        for (size_t i = 0; i < files.size(); ++i) {
+            Path::makedirs(files[i].path.parent());
+            int fd = ::open(files[i].path.string().c_str(),
+                O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+            if (fd != -1) {
+                ::fallocate(fd, 0, 0, files[i].size);
+                ::close(fd);
+            }
+        }
+    });
+    report("16k files fallocate, 64KiB each", baseline, baseline);
+    Path::rmdirs(tree);
+    ::sync();
+
+    report("16k files Path::create, 64KiB each",
+        timed([&]() { Path::create(files); }), baseline);
+    Path::rmdirs(tree);
+}
+
+int main() {
+    Path::rmdirs(scratch, true);
+    Path::makedirs(scratch);
+
+    bench_copy();
+    bench_tree_stats();
+    bench_pathlist();
+    bench_sort();
+    bench_segments();
+    bench_common_prefix();
+    bench_create();
+
+    Path::rmdirs(scratch, true);
+    return 0;
+}
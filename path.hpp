@@ -26,6 +26,7 @@
 
 /* C++ includes */
 #include <vector>
+#include <initializer_list>
 #include <string>
 #include <cstring>
 #include <cstdlib>
@@ -33,18 +34,155 @@
 #include <sstream>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
 /* C includes */
 #include <glob.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif
 
 /* A class for path manipulation */
 namespace apathy {
+    /* A read-only, memory-mapped view of a file's contents. The mapping is
+     * released when this goes out of scope. Obtained through `Path::map` */
+    class MappedFile {
+    public:
+        MappedFile(): addr(NULL), length(0), mapped(false) {}
+
+        MappedFile(MappedFile&& other):
+            addr(other.addr), length(other.length), mapped(other.mapped) {
+            other.release();
+        }
+
+        MappedFile& operator=(MappedFile&& other) {
+            if (this != &other) {
+                unmap();
+                addr = other.addr;
+                length = other.length;
+                mapped = other.mapped;
+                other.release();
+            }
+            return *this;
+        }
+
+        ~MappedFile() { unmap(); }
+
+        /* Was the file successfully mapped? Empty files map successfully */
+        bool valid() const { return mapped; }
+
+        /* The contents of the file */
+        const char* data() const { return static_cast<const char*>(addr); }
+        size_t size() const { return length; }
+        bool empty() const { return length == 0; }
+
+        const char* begin() const { return data(); }
+        const char* end() const { return data() + length; }
+
+    private:
+        friend class Path;
+
+        MappedFile(void* addr, size_t length):
+            addr(addr), length(length), mapped(true) {}
+
+        /* Mappings can't be shared */
+        MappedFile(const MappedFile& other) = delete;
+        MappedFile& operator=(const MappedFile& other) = delete;
+
+        /* Forget about the mapping without unmapping it */
+        void release() {
+            addr = NULL;
+            length = 0;
+            mapped = false;
+        }
+
+        void unmap() {
+            if (addr != NULL) {
+                munmap(addr, length);
+            }
+            release();
+        }
+
+        /* The start of the mapping, NULL for empty files */
+        void* addr;
+        /* The size of the mapping */
+        size_t length;
+        /* Whether or not this refers to a file */
+        bool mapped;
+    };
+
+    /* A cache of resolved directories for `Path::canonical`
+     *
+     * Maps absolute directory paths (as written) to the physical paths they
+     * resolve to, so that canonicalizing many paths under the same tree only
+     * needs to examine each directory once. It is safe to share between
+     * threads. Entries may optionally expire, to bound how long changes to
+     * symlinks go unnoticed */
+    class CanonicalCache {
+    public:
+        /* @param capacity - roughly how many directories to remember
+         * @param ttl - how long entries are trusted, or 0 for ever */
+        CanonicalCache(size_t capacity=65536,
+            std::chrono::milliseconds ttl=std::chrono::milliseconds(0)):
+            mutex(), current(), previous(), capacity(capacity), ttl(ttl) {}
+
+        /* Look up what a directory resolved to
+         *
+         * @returns true if it was found, and hasn't expired */
+        bool lookup(const std::string& dir, std::string& resolved);
+
+        /* Remember what a directory resolved to */
+        void store(const std::string& dir, const std::string& resolved);
+
+        /* Forget everything */
+        void clear();
+
+        /* The number of directories remembered */
+        size_t size() const;
+
+        /* The cache used when none is given */
+        static CanonicalCache& shared();
+
+    private:
+        typedef std::chrono::steady_clock clock;
+        typedef std::unordered_map<std::string,
+            std::pair<std::string, clock::time_point> > Entries;
+
+        CanonicalCache(const CanonicalCache& other) = delete;
+        CanonicalCache& operator=(const CanonicalCache& other) = delete;
+
+        mutable std::mutex mutex;
+        /* New entries go in current. When it fills up, it replaces
+         * previous, and entries are promoted back out of previous as
+         * they're used. So the cache is bounded, and recently used entries
+         * survive */
+        Entries current;
+        Entries previous;
+        size_t capacity;
+        std::chrono::milliseconds ttl;
+    };
+
     class Path {
     public:
         /* This is the separator used on this particular system */
@@ -65,6 +203,53 @@ namespace apathy {
             }
         };
 
+        /* Options for `copy` and `copytree`, which may be or'd together */
+        enum CopyOptions {
+            /* Give the copy the same permission bits as the original */
+            COPY_MODE      = 1,
+            /* Give the copy the same access and modification times */
+            COPY_TIMES     = 2,
+            /* Replace the destination if it already exists */
+            COPY_OVERWRITE = 4
+        };
+
+        /* Totals for everything in a directory tree, from `tree_stats` */
+        struct TreeStats {
+            TreeStats(): bytes(0), allocated(0), files(0), directories(0),
+                symlinks(0), others(0), entries_by_depth(),
+                bytes_by_depth() {}
+
+            /* Apparent size of everything, in bytes */
+            unsigned long long bytes;
+            /* Space allocated on disk for everything, in bytes */
+            unsigned long long allocated;
+            /* The number of each kind of entry, including the root */
+            size_t files;
+            size_t directories;
+            size_t symlinks;
+            size_t others;
+            /* The number of entries and their apparent size at each depth,
+             * where the root is at depth 0 */
+            std::vector<size_t> entries_by_depth;
+            std::vector<unsigned long long> bytes_by_depth;
+        };
+
+        /* A file for `create` to make */
+        struct FileSpec;
+
+        /* How hard `atomic_write` works to make a write survive a crash.
+         * Readers always see either the old or the new contents */
+        enum SyncPolicy {
+            /* Nothing is flushed. After a crash, the file may be empty */
+            SYNC_NONE,
+            /* The contents are flushed before being renamed into place, so
+             * after a crash the file has either the old or new contents */
+            SYNC_DATA,
+            /* The directory is flushed after the rename as well, so once
+             * `atomic_write` returns, the new contents will survive a crash */
+            SYNC_FULL
+        };
+
         /**********************************************************************
          * Constructors
          *********************************************************************/
@@ -72,7 +257,22 @@ namespace apathy {
         /* Default constructor
          *
          * Points to current directory */
-        Path(const std::string& path=""): path(path) {}
+        Path(const std::string& path=""): path(path), index(NULL) {}
+
+        /* Construct from a string that's no longer needed, without copying
+         * it */
+        Path(std::string&& path): path(std::move(path)), index(NULL) {}
+
+        /* Construct from a C string, without going through a stringstream */
+        Path(const char* path): path(path ? path : ""), index(NULL) {}
+
+        /* Copies don't share the original's segment index; they build their
+         * own if they need one */
+        Path(const Path& other): path(other.path), index(NULL) {}
+        Path(Path&& other) noexcept: path(std::move(other.path)),
+            index(other.index.exchange(NULL)) {}
+
+        ~Path() { forget_index(); }
 
         /* Our generalized constructor.
          *
@@ -87,6 +287,19 @@ namespace apathy {
         /**********************************************************************
          * Operators
          *********************************************************************/
+        Path& operator=(const Path& other) {
+            path = other.path;
+            forget_index();
+            return *this;
+        }
+        Path& operator=(Path&& other) noexcept {
+            if (this != &other) {
+                path = std::move(other.path);
+                delete[] index.exchange(other.index.exchange(NULL));
+            }
+            return *this;
+        }
+
         /* Checks if the paths are exactly the same */
         bool operator==(const Path& other) { return path == other.path; }
 
@@ -97,14 +310,20 @@ namespace apathy {
          * same as append(segment)
          *
          * @param segment - path segment to add to this path */
-        Path& operator<<(const Path& segment);
+        Path& operator<<(const Path& segment) &;
+        Path operator<<(const Path& segment) && {
+            return std::move(append(segment));
+        }
 
         /* Append the provided segment to the path as a directory. This is the
          * same as append(segment). Returns a /new/ path object rather than a
-         * reference.
+         * reference. On a temporary, the temporary's storage is reused
          *
          * @param segment - path segment to add to this path */
-        Path operator+(const Path& segment) const;
+        Path operator+(const Path& segment) const &;
+        Path operator+(const Path& segment) && {
+            return std::move(append(segment));
+        }
 
         /* Check if the two paths are equivalent
          *
@@ -114,8 +333,17 @@ namespace apathy {
          * @param other - path to compare to */
         bool equivalent(const Path& other);
 
+        /* Check if the two paths refer to the same file on disk
+         *
+         * Unlike `equivalent`, this follows symlinks and hard links, by
+         * comparing device and inode numbers. Paths that don't exist are
+         * never physically equivalent
+         *
+         * @param other - path to compare to */
+        bool equivalent_physical(const Path& other) const;
+
         /* Return a string version of this path */
-        std::string string() const { return path; }
+        const std::string& string() const { return path; }
 
         /* Return the name of the file */
         std::string filename() const;
@@ -126,30 +354,48 @@ namespace apathy {
         /* Return a path object without the extension */
         Path stem() const;
 
+        /* Make room for the path to grow to `capacity` bytes without
+         * reallocating, as when appending several segments */
+        Path& reserve(size_t capacity) {
+            path.reserve(capacity);
+            return *this;
+        }
+
         /**********************************************************************
          * Manipulations
+         *
+         * Each of these modifies the path and returns a reference to it. When
+         * called on a temporary, they instead return the modified path by
+         * value, moving it out of the temporary, so that expressions like
+         * `Path(a).append(b).sanitize()` never copy the path
          *********************************************************************/
 
         /* Append the provided segment to the path as a directory. Alias for
          * `operator<<`
          *
          * @param segment - path segment to add to this path */
-        Path& append(const Path& segment);
+        Path& append(const Path& segment) &;
+        Path append(const Path& segment) && {
+            return std::move(append(segment));
+        }
 
         /* Evaluate the provided path relative to this path. If the second path
          * is absolute, then return the second path.
          *
          * @param rel - path relative to this path to evaluate */
-        Path& relative(const Path& rel);
+        Path& relative(const Path& rel) &;
+        Path relative(const Path& rel) && { return std::move(relative(rel)); }
 
         /* Move up one level in the directory structure */
-        Path& up();
+        Path& up() &;
+        Path up() && { return std::move(up()); }
 
         /* Turn this into an absolute path
          *
          * If the path is already absolute, it has no effect. Otherwise, it is
          * evaluated relative to the current working directory */
-        Path& absolute();
+        Path& absolute() &;
+        Path absolute() && { return std::move(absolute()); }
 
         /* Sanitize this path
          *
@@ -163,13 +409,15 @@ namespace apathy {
          * afterwards. If it was a relative path to begin with, it will only be
          * converted to an absolute path if it uses enough '..'s to refer to
          * directories above the current working directory */
-        Path& sanitize();
+        Path& sanitize() &;
+        Path sanitize() && { return std::move(sanitize()); }
 
         /* Make this path a directory
          *
          * If this path does not have a trailing directory separator, add one.
          * If it already does, this does not affect the path */
-        Path& directory();
+        Path& directory() &;
+        Path directory() && { return std::move(directory()); }
 
         /* Trim this path of trailing separators, up to the leading separator.
          * For example, on *nix systems:
@@ -177,7 +425,25 @@ namespace apathy {
          *   assert(Path("///").trim() == "/");
          *   assert(Path("/foo//").trim() == "/foo");
          */
-        Path& trim();
+        Path& trim() &;
+        Path trim() && { return std::move(trim()); }
+
+        /* Resolve this path to its physical location
+         *
+         * Makes the path absolute, and resolves symlinks, '.' and '..' one
+         * segment at a time, as the kernel would. Anything past the part of
+         * the path that exists is sanitized as with `sanitize`. The result
+         * has no trailing separator.
+         *
+         * Directories that have been resolved before are looked up in a
+         * cache, so resolving a path in a known directory usually takes a
+         * single lstat(2)
+         *
+         * @param cache - the cache of resolved directories to use */
+        Path& canonical(CanonicalCache& cache=CanonicalCache::shared()) &;
+        Path canonical(CanonicalCache& cache=CanonicalCache::shared()) && {
+            return std::move(canonical(cache));
+        }
 
         /**********************************************************************
          * Copiers
@@ -186,8 +452,42 @@ namespace apathy {
         /* Return parent path
          *
          * Returns a new Path object referring to the parent directory. To
-         * move _this_ path to the parent directory, use the `up` function */
-        Path parent() const { return Path(Path(*this).up()); }
+         * move _this_ path to the parent directory, use the `up` function.
+         * Unless the path has '.', '..' or repeated separators, this just
+         * truncates it at its last segment */
+        Path parent() const;
+
+        /* Return this path relative to another
+         *
+         * Gives the path that, evaluated relative to `base`, refers to this
+         * path. For example, `/a/b/c` relative to `/a/d` is `../b/c`. If only
+         * one of the two is absolute, both are made absolute first, and
+         * paths with '.', '..' or repeated separators are compared as if
+         * sanitized. Identical paths give an empty path
+         *
+         * @param base - path to make this one relative to */
+        Path relative_to(const Path& base) const;
+
+        /**********************************************************************
+         * Segments
+         *
+         * The offsets of each segment in a path are found the first time
+         * they're needed, and kept until the path is modified, so that
+         * repeated queries don't rescan it. Since that first query updates
+         * the path, it's not safe to make from several threads at once.
+         *
+         * Empty segments (from leading, trailing or repeated separators)
+         * aren't counted, so `/foo//bar/` has two segments
+         *********************************************************************/
+
+        /* The number of non-empty segments in this path */
+        size_t segment_count() const { return offsets()[0]; }
+
+        /* The non-empty segment at position i, or an empty string if there
+         * aren't that many
+         *
+         * @param i - position of the segment, starting from 0 */
+        std::string segment(size_t i) const;
 
         /**********************************************************************
          * Member Utility Methods
@@ -228,6 +528,28 @@ namespace apathy {
          * returns 0 */
         size_t size() const;
 
+        /**********************************************************************
+         * Reading
+         *********************************************************************/
+
+        /* Map this file into memory, read-only
+         *
+         * Returns an invalid MappedFile if the file can't be opened or mapped
+         *
+         * @param advice - madvise(2) hint for how the contents will be read
+         * @param populate - fault in the whole file up front */
+        MappedFile map(int advice=MADV_SEQUENTIAL, bool populate=false) const;
+
+        /* Read the entire contents of this file
+         *
+         * The file is opened and stat'd once, and read with pread(2)
+         * directly into `contents`. Copying out of a mapping is no faster,
+         * so to avoid the copy altogether, use `map` instead
+         *
+         * @param contents - replaced with the contents of the file
+         * @returns true if the whole file was read, false otherwise */
+        bool read_all(std::string& contents) const;
+
         /**********************************************************************
          * Static Utility Methods
          *********************************************************************/
@@ -240,12 +562,43 @@ namespace apathy {
          */
         static Path join(const Path& a, const Path& b);
 
+        /* Return a brand new path as the concatenation of all the provided
+         * paths, allocating only once
+         *
+         * @param a, b, c, rest... - parts of the path to join, in order */
+        template <class... Rest>
+        static Path join(const Path& a, const Path& b, const Path& c,
+            const Rest&... rest) {
+            /* Any converted arguments live until the end of this statement,
+             * so the list has to be used within it */
+            return join({ &a, &b, &c, &address(rest)... });
+        }
+
         /* Return a branch new path as the concatenation of each segments
          *
          * @param segments - the path segments to concatenate
          */
         static Path join(const std::vector<Segment>& segments);
 
+        /* The longest path that both paths are under, by whole segments
+         *
+         * For example, the common prefix of `/a/b/c` and `/a/bd` is `/a`.
+         * If only one of the two is absolute, both are made absolute first,
+         * and paths with '.', '..' or repeated separators are compared as
+         * if sanitized. The result has no trailing separator
+         *
+         * @param a, b - paths to find the common prefix of */
+        static Path common_prefix(const Path& a, const Path& b);
+
+        /* The longest path that all the paths are under, by whole segments,
+         * as with `common_prefix(a, b)`. An empty list gives an empty path
+         *
+         * @param paths - paths to find the common prefix of
+         * @param threads - how many threads to use for large lists, or 0 for
+         *     one per core */
+        static Path common_prefix(const std::vector<Path>& paths,
+            size_t threads=0);
+
         /* Current working directory */
         static Path cwd();
 
@@ -268,6 +621,57 @@ namespace apathy {
          * @param path - path to remove */
         static bool rm(const Path& path);
 
+        /* Total up the sizes of everything in a directory tree, like du(1)
+         *
+         * Directories are read in parallel, and entries are stat'd relative
+         * to their directory's descriptor. Files with several hard links
+         * are only counted once
+         *
+         * @param root - directory to total up
+         * @param one_filesystem - skip directories on other filesystems
+         * @param threads - number of threads (0 for one per core) */
+        static TreeStats tree_stats(const Path& root,
+            bool one_filesystem=false, size_t threads=0);
+
+        /* Create many files at once, each if it doesn't already exist
+         *
+         * Files are grouped by directory, and each group is created relative
+         * to its directory's descriptor, in parallel. Missing directories are
+         * made once per directory rather than once per file. Files with a
+         * size are preallocated to at least that size with fallocate(2)
+         * where it's supported, or extended with ftruncate(2) where it's not.
+         * Existing files are never truncated
+         *
+         * @param files - files to create
+         * @param threads - number of threads (0 for one per core)
+         * @returns for each file, 0 if it exists (whether it was created or
+         *     was already there), or else the errno */
+        static std::vector<int> create(const std::vector<FileSpec>& files,
+            size_t threads=0);
+
+        /* Copy a file
+         *
+         * The contents are copied with the cheapest mechanism available,
+         * trying in turn a reflink (sharing the source's extents), then
+         * copy_file_range(2), sendfile(2) and finally a read / write loop
+         *
+         * @param source - file to copy
+         * @param dest - path of the copy
+         * @param options - bitwise or of CopyOptions */
+        static bool copy(const Path& source, const Path& dest, int options=0);
+
+        /* Recursively copy a directory
+         *
+         * The directory structure is made first, and then files are copied
+         * in parallel. Symlinks are copied as symlinks.
+         *
+         * @param source - directory to copy
+         * @param dest - path of the copy
+         * @param options - bitwise or of CopyOptions
+         * @param threads - number of copying threads (0 for one per core) */
+        static bool copytree(const Path& source, const Path& dest,
+            int options=0, size_t threads=0);
+
         /* Recursively make directories
          *
          * @param p - path to recursively make
@@ -289,18 +693,320 @@ namespace apathy {
          * @param pattern - the glob pattern to match */
         static std::vector<Path> glob(const std::string& pattern);
 
+        /* Replace the contents of a file, creating it if need be
+         *
+         * @param p - path to write to
+         * @param contents - what to write
+         * @param mode - mode to create with */
+        static bool write_all(const Path& p, const std::string& contents,
+            mode_t mode=0666);
+
+        /* Atomically replace the contents of a file
+         *
+         * The contents are written to an anonymous (O_TMPFILE) or uniquely
+         * named temporary file in the same directory, which is then renamed
+         * over the destination. To write many files at once, sharing the
+         * cost of flushing their directories, use a WriteBatch
+         *
+         * @param p - path to write to
+         * @param contents - what to write
+         * @param sync - how much to flush to disk
+         * @param mode - mode to create with */
+        static bool atomic_write(const Path& p, const std::string& contents,
+            SyncPolicy sync=SYNC_FULL, mode_t mode=0666);
+
         /* So that we can write paths out to ostreams */
         friend std::ostream& operator<<(std::ostream& stream, const Path& p) {
             return stream << p.path;
         }
     private:
+        friend class WriteBatch;
+        friend class Directory;
+
+        /* Converts each argument of the variadic `join` to a Path that lives
+         * until the end of the call */
+        static const Path& address(const Path& p) { return p; }
+
+        /* Join parts, sizing the result up front */
+        static Path join(std::initializer_list<const Path*> parts);
+
+        /* What `normalized` found out about the paths it was given */
+        enum PathKinds {
+            KIND_ABSOLUTE = 1,
+            KIND_RELATIVE = 2,
+            /* Relative paths that start with '..' */
+            KIND_ESCAPES  = 4
+        };
+
+        /* Does the path have no '.', '..' or repeated separators? */
+        static bool clean(const std::string& path);
+
+        /* A clean version of p, which is p itself if it's already clean, or
+         * else a sanitized copy in storage. With `absolute`, relative paths
+         * are made absolute as well. The kinds of path seen are or'd into
+         * kinds */
+        static const Path& normalized(const Path& p, bool absolute,
+            Path& storage, int& kinds);
+
+        /* The length of the common prefix of clean paths a and b, by whole
+         * segments, considering only the first a_size bytes of a, which must
+         * end at a segment boundary */
+        static size_t common_length(const char* a, size_t a_size,
+            const char* b, size_t b_size);
+
+        /* The common prefix of n paths, where at(i) gives the ith */
+        template <class F>
+        static Path common_prefix(size_t n, F at, bool absolute, int& kinds);
+
+        /* The directory part of this path, without sanitizing. This is '.'
+         * for paths with no separator */
+        std::string dirname() const;
+
+        /* A name for a temporary file next to this path, unique within this
+         * process */
+        std::string temp_name() const;
+
+        /* Write all of contents to fd, retrying on short writes */
+        static bool write_fd(int fd, const std::string& contents);
+
+        /* Write contents to a new, uniquely named file next to p, flushing it
+         * if the policy asks for it. On success, temp holds its name */
+        static bool write_temp(const Path& p, const std::string& contents,
+            SyncPolicy sync, mode_t mode, std::string& temp);
+
+        /* Flush a directory's entries to disk */
+        static bool sync_directory(const std::string& dir);
+
+        /* Copy the contents of one open file to another, from their current
+         * offsets, applying the metadata asked for in options */
+        static bool copy_fd(int in, int out, const struct stat& st,
+            int options);
+
+        /* Resolve one more segment onto an absolute, resolved path,
+         * following symlinks. Once something is missing (or there are too
+         * many symlinks), segments are only appended lexically */
+        static void resolve(std::string& resolved, const std::string& segment,
+            int& links, bool& missing);
+
+        /* Shared state for a tree_stats traversal */
+        struct TreeWalk;
+
+        /* Total up a directory for tree_stats, recursing into its
+         * subdirectories or handing them off to other threads */
+        static void tree_stats(TreeWalk& walk, int dir, size_t depth,
+            TreeStats& stats);
+
+        /* Count one entry for tree_stats */
+        static void tree_count(TreeStats& stats, const struct stat& buf,
+            size_t depth);
+
+        /* Create files[begin, end) in dir, preallocating any with a size.
+         * The errno for each (or 0) is stored in results */
+        static void create_in(int dir, const std::vector<FileSpec>& files,
+            const std::vector<size_t>& order, size_t begin, size_t end,
+            std::vector<int>& results);
+
+        /* Make the directory structure of a copytree, collecting the files
+         * that still need to be copied and the directories created */
+        static bool copytree_dirs(const Path& source, const Path& dest,
+            int options, std::vector<std::pair<Path, Path> >& files,
+            std::vector<std::pair<Path, struct stat> >& dirs);
+
+        /* The segment index, building it if need be. Its layout is the
+         * number of segments, whether the path is clean (has no '.', '..' or
+         * repeated separators), and then the start and end of each segment */
+        const uint32_t* offsets() const;
+
+        /* Drop the segment index after the path changes */
+        void forget_index() { delete[] index.exchange(NULL); }
+
         /* Our current path */
         std::string path;
+
+        /* The segment index, or null if it hasn't been needed since the path
+         * last changed. Const methods may build it from several threads at
+         * once, so it's published with a compare-and-swap */
+        mutable std::atomic<uint32_t*> index;
+    };
+
+    struct Path::FileSpec {
+        FileSpec(const Path& path, mode_t mode=0666, off_t size=0):
+            path(path), mode(mode), size(size) {}
+
+        /* Where to create it */
+        Path path;
+        /* The mode to create it with, before the umask */
+        mode_t mode;
+        /* The size to preallocate, or 0 to leave it empty */
+        off_t size;
+    };
+
+    /* Group commit for atomic writes
+     *
+     * Each file added is written to a temporary file straight away, and then
+     * on `commit` they're all renamed into place. Each directory written to
+     * is only flushed once per commit, rather than once per file. Every file
+     * is replaced atomically, but the batch as a whole is not: after a crash
+     * during a commit, some files may have their new contents and others
+     * their old. Anything not committed is discarded on destruction */
+    class WriteBatch {
+    public:
+        WriteBatch(Path::SyncPolicy sync=Path::SYNC_FULL):
+            sync(sync), pending() {}
+
+        ~WriteBatch() { discard(); }
+
+        /* Write the contents for a path, to be put in place on commit
+         *
+         * @param p - path to write to
+         * @param contents - what to write
+         * @param mode - mode to create with */
+        bool add(const Path& p, const std::string& contents,
+            mode_t mode=0666);
+
+        /* Rename everything into place, and flush directories as the policy
+         * requires. Returns false if anything failed, but still attempts
+         * every file */
+        bool commit();
+
+        /* Remove the temporary files of anything not yet committed */
+        void discard();
+
+        /* The number of writes waiting to be committed */
+        size_t size() const { return pending.size(); }
+
+    private:
+        WriteBatch(const WriteBatch& other) = delete;
+        WriteBatch& operator=(const WriteBatch& other) = delete;
+
+        /* How much to flush */
+        Path::SyncPolicy sync;
+        /* Pairs of temporary file name and destination */
+        std::vector<std::pair<std::string, Path> > pending;
+    };
+
+    /* A handle to an open directory
+     *
+     * Every Path operation hands the kernel a complete path, which it walks
+     * one segment at a time on every call. A Directory holds the directory
+     * open, so that operations relative to it (through the *at system calls)
+     * only walk the remaining segments. It also keeps referring to the same
+     * directory if it's renamed. The descriptor is closed when the handle
+     * goes out of scope.
+     *
+     * Paths given to these methods are relative to the directory, unless
+     * they're absolute, in which case the directory is ignored */
+    class Directory {
+    public:
+        /* A handle that doesn't refer to anything */
+        Directory(): fd(-1), base() {}
+
+        /* Open a directory. Check `valid` to see whether it succeeded
+         *
+         * @param p - directory to open */
+        explicit Directory(const Path& p);
+
+        Directory(Directory&& other): fd(other.fd), base(std::move(other.base)) {
+            other.fd = -1;
+        }
+
+        Directory& operator=(Directory&& other);
+
+        ~Directory() { close(); }
+
+        /* Was the directory successfully opened? */
+        bool valid() const { return fd != -1; }
+
+        /* The underlying file descriptor */
+        int descriptor() const { return fd; }
+
+        /* The path this was opened with */
+        const Path& path() const { return base; }
+
+        /* Open a directory relative to this one
+         *
+         * @param rel - directory to open */
+        Directory open(const Path& rel) const;
+
+        /* stat(2) a path relative to this directory
+         *
+         * @param rel - path to stat
+         * @param buf - filled in with the results
+         * @param follow - follow a final symlink */
+        bool stat(const Path& rel, struct stat& buf, bool follow=true) const;
+
+        /* As with the Path equivalents */
+        bool exists(const Path& rel) const;
+        bool is_file(const Path& rel) const;
+        bool is_directory(const Path& rel) const;
+
+        /* Create a file if one does not exist, making any needed
+         * directories
+         *
+         * @param rel - path to create
+         * @param mode - mode to create with */
+        bool touch(const Path& rel, mode_t mode=0777) const;
+
+        /* Recursively make directories, opening one segment at a time
+         *
+         * @param rel - path to recursively make
+         * @param mode - mode to create with */
+        bool makedirs(const Path& rel, mode_t mode=0777) const;
+
+        /* Move / rename a file
+         *
+         * @param source - original path
+         * @param dest - new path
+         * @param mkdirs - recursively make any needed directories? */
+        bool move(const Path& source, const Path& dest,
+            bool mkdirs=false) const;
+
+        /* Move / rename a file into another directory
+         *
+         * @param source - original path, relative to this directory
+         * @param to - directory to move into
+         * @param dest - new path, relative to `to` */
+        bool move_to(const Path& source, const Directory& to,
+            const Path& dest) const;
+
+        /* Remove a file or empty directory
+         *
+         * @param rel - path to remove */
+        bool rm(const Path& rel) const;
+
+        /* The names of everything in this directory (not including '.' and
+         * '..'), in no particular order */
+        std::vector<Path> listdir() const;
+
+        /* Paths relative to this directory that match a glob pattern, in
+         * sorted order. As with glob(3), wildcards don't match a leading '.'
+         *
+         * @param pattern - the glob pattern to match */
+        std::vector<Path> glob(const std::string& pattern) const;
+
+    private:
+        Directory(int fd, const Path& base): fd(fd), base(base) {}
+
+        Directory(const Directory& other) = delete;
+        Directory& operator=(const Directory& other) = delete;
+
+        void close();
+
+        /* Match the segments of a glob pattern from `index` on, in the
+         * directory `dir`, whose path relative to this one is `prefix` */
+        static void glob(int dir, const std::string& prefix,
+            const std::vector<std::string>& segments, size_t index,
+            std::vector<Path>& results);
+
+        /* The open directory */
+        int fd;
+        /* The path it was opened with */
+        Path base;
     };
 
     /* Constructor */
     template <class T>
-    inline Path::Path(const T& p): path("") {
+    inline Path::Path(const T& p): path(""), index(NULL) {
         std::stringstream ss;
         ss << p;
         path = ss.str();
@@ -309,14 +1015,12 @@ namespace apathy {
     /**************************************************************************
      * Operators
      *************************************************************************/
-    inline Path& Path::operator<<(const Path& segment) {
+    inline Path& Path::operator<<(const Path& segment) & {
         return append(segment);
     }
 
-    inline Path Path::operator+(const Path& segment) const {
-        Path result(path);
-        result.append(segment);
-        return result;
+    inline Path Path::operator+(const Path& segment) const & {
+        return join(*this, segment);
     }
 
     inline bool Path::equivalent(const Path& other) {
@@ -325,6 +1029,14 @@ namespace apathy {
                Path(other).absolute().sanitize();
     }
 
+    inline bool Path::equivalent_physical(const Path& other) const {
+        struct stat a, b;
+        if (stat(path.c_str(), &a) != 0 || stat(other.path.c_str(), &b) != 0) {
+            return false;
+        }
+        return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    }
+
     inline std::string Path::filename() const {
         size_t pos = path.rfind(separator);
         if (pos != std::string::npos) {
@@ -360,7 +1072,7 @@ namespace apathy {
     /**************************************************************************
      * Manipulators
      *************************************************************************/
-    inline Path& Path::append(const Path& segment) {
+    inline Path& Path::append(const Path& segment) & {
         /* First, check if the last character is the separator character.
          * If not, then append one and then the segment. Otherwise, just
          * the segment */
@@ -368,10 +1080,11 @@ namespace apathy {
             path.push_back(separator);
         }
         path.append(segment.path);
+        forget_index();
         return *this;
     }
 
-    inline Path& Path::relative(const Path& rel) {
+    inline Path& Path::relative(const Path& rel) & {
         if (!rel.is_absolute()) {
             return append(rel);
         } else {
@@ -380,11 +1093,12 @@ namespace apathy {
         }
     }
 
-    inline Path& Path::up() {
+    inline Path& Path::up() & {
         /* Make sure we turn this into an absolute url if it's not already
          * one */
         if (path.size() == 0) {
             path = "..";
+            forget_index();
             return directory();
         }
         
@@ -395,18 +1109,18 @@ namespace apathy {
         return directory();
     }
 
-    inline Path& Path::absolute() {
+    inline Path& Path::absolute() & {
         /* If the path doesn't begin with our separator, then it's not an
          * absolute path, and should be appended to the current working
          * directory */
         if (!is_absolute()) {
             /* Join our current working directory with the path */
-            operator=(join(cwd(), path));
+            operator=(cwd().append(*this));
         }
         return *this;
     }
 
-    inline Path& Path::sanitize() {
+    inline Path& Path::sanitize() & {
         /* Split the path up into segments */
         std::vector<Segment> segments(split());
         /* We may have to test this repeatedly, so let's check once */
@@ -443,6 +1157,7 @@ namespace apathy {
         }
         
         bool was_directory = trailing_slash();
+        forget_index();
         if (!relative) {
             path = std::string(1, separator) + Path::join(pruned).path;
             if (was_directory) {
@@ -459,15 +1174,17 @@ namespace apathy {
         return *this;
     }
 
-    inline Path& Path::directory() {
+    inline Path& Path::directory() & {
         trim();
         path.push_back(separator);
+        forget_index();
         return *this;
     }
 
-    inline Path& Path::trim() {
+    inline Path& Path::trim() & {
         if (path.length() == 0) { return *this; }
 
+        forget_index();
         size_t p = path.find_last_not_of(separator);
         if (p != std::string::npos) {
             path.erase(p + 1, path.size());
@@ -477,6 +1194,171 @@ namespace apathy {
         return *this;
     }
 
+    inline void Path::resolve(std::string& resolved,
+        const std::string& segment, int& links, bool& missing) {
+        if (segment.empty() || segment == ".") {
+            return;
+        }
+
+        if (segment == "..") {
+            size_t pos = resolved.rfind(separator);
+            resolved.erase(pos == 0 ? 1 : pos);
+            return;
+        }
+
+        size_t length = resolved.size();
+        if (resolved.size() > 1) {
+            resolved.push_back(separator);
+        }
+        resolved.append(segment);
+        if (missing) {
+            return;
+        }
+
+        struct stat buf;
+        if (lstat(resolved.c_str(), &buf) != 0) {
+            missing = true;
+            return;
+        } else if (!S_ISLNK(buf.st_mode)) {
+            return;
+        }
+
+        /* Same limit as Linux */
+        if (++links > 40) {
+            missing = true;
+            return;
+        }
+
+        std::string target(buf.st_size ? buf.st_size : PATH_MAX, '\0');
+        ssize_t n = readlink(resolved.c_str(), &target[0], target.size());
+        if (n < 0) {
+            missing = true;
+            return;
+        }
+        target.resize(n);
+
+        /* The link is replaced by its target, relative to where it is */
+        if (target.size() && target[0] == separator) {
+            resolved.assign(1, separator);
+        } else {
+            resolved.resize(length);
+        }
+
+        std::stringstream stream(target);
+        for (Segment s; stream >> s;) {
+            resolve(resolved, s.segment, links, missing);
+        }
+    }
+
+    inline Path& Path::canonical(CanonicalCache& cache) & {
+        absolute();
+
+        /* Collect the segments, ignoring any that don't do anything */
+        std::vector<std::string> segments;
+        size_t parents = std::string::npos;
+        std::stringstream stream(path);
+        for (Segment s; stream >> s;) {
+            if (s.segment.empty() || s.segment == ".") {
+                continue;
+            } else if (s.segment == ".." && parents == std::string::npos) {
+                parents = segments.size();
+            }
+            segments.push_back(s.segment);
+        }
+
+        /* Only directories up to the first '..' can be cached, since their
+         * names depend only on the segments before them */
+        size_t cacheable = std::min(parents,
+            segments.size() ? segments.size() - 1 : 0);
+        std::vector<size_t> ends(1, 1);
+        std::string prefix(1, separator);
+        for (size_t i = 0; i < cacheable; ++i) {
+            if (i) {
+                prefix.push_back(separator);
+            }
+            prefix.append(segments[i]);
+            ends.push_back(prefix.size());
+        }
+
+        /* Start from the longest directory we already know about */
+        std::string resolved(1, separator);
+        size_t start = 0;
+        for (size_t i = cacheable; i > 0; --i) {
+            if (cache.lookup(prefix.substr(0, ends[i]), resolved)) {
+                start = i;
+                break;
+            }
+        }
+
+        int links = 0;
+        bool missing = false;
+        for (size_t i = start; i < segments.size(); ++i) {
+            resolve(resolved, segments[i], links, missing);
+            if (i < cacheable && !missing) {
+                cache.store(prefix.substr(0, ends[i + 1]), resolved);
+            }
+        }
+
+        path.swap(resolved);
+        forget_index();
+        return *this;
+    }
+
+    inline bool CanonicalCache::lookup(const std::string& dir,
+        std::string& resolved) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entries::iterator it(current.find(dir));
+        if (it == current.end()) {
+            it = previous.find(dir);
+            if (it == previous.end()) {
+                return false;
+            }
+        }
+
+        if (ttl.count() && clock::now() - it->second.second > ttl) {
+            return false;
+        }
+        resolved = it->second.first;
+
+        /* Keep entries that are still being used */
+        if (current.find(dir) == current.end()) {
+            std::pair<std::string, clock::time_point> entry(it->second);
+            previous.erase(it);
+            if (current.size() * 2 >= capacity) {
+                previous.swap(current);
+                current.clear();
+            }
+            current[dir] = entry;
+        }
+        return true;
+    }
+
+    inline void CanonicalCache::store(const std::string& dir,
+        const std::string& resolved) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current.size() * 2 >= capacity) {
+            previous.swap(current);
+            current.clear();
+        }
+        current[dir] = std::make_pair(resolved, clock::now());
+    }
+
+    inline void CanonicalCache::clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.clear();
+        previous.clear();
+    }
+
+    inline size_t CanonicalCache::size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current.size() + previous.size();
+    }
+
+    inline CanonicalCache& CanonicalCache::shared() {
+        static CanonicalCache cache;
+        return cache;
+    }
+
     /**************************************************************************
      * Member Utility Methods
      *************************************************************************/
@@ -494,19 +1376,134 @@ namespace apathy {
     }
 
     /**************************************************************************
-     * Tests
+     * Segments
      *************************************************************************/
-    inline bool Path::is_absolute() const {
-        return path.size() && path[0] == separator;
-    }
+    inline const uint32_t* Path::offsets() const {
+        uint32_t* existing = index.load(std::memory_order_acquire);
+        if (existing != NULL) {
+            return existing;
+        }
 
-    inline bool Path::trailing_slash() const {
-        return path.size() && path[path.length() - 1] == separator;
-    }
+        /* Count the segments first, so the index is a single allocation */
+        size_t count = 0;
+        for (size_t i = 0; i < path.size(); ++i) {
+            if (path[i] != separator && (i == 0 || path[i - 1] == separator)) {
+                ++count;
+            }
+        }
 
-    inline bool Path::exists() const {
-        struct stat buf;
-        if (stat(path.c_str(), &buf) != 0) {
+        uint32_t* result = new uint32_t[2 + 2 * count];
+        result[0] = count;
+        result[1] = true;
+        uint32_t* segment = result + 2;
+        for (size_t i = 0; i < path.size();) {
+            if (path[i] == separator) {
+                if (i > 0 && path[i - 1] == separator) {
+                    result[1] = false;
+                }
+                ++i;
+                continue;
+            }
+
+            size_t end = path.find(separator, i);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            if (path[i] == '.' && (end - i == 1 ||
+                (end - i == 2 && path[i + 1] == '.'))) {
+                result[1] = false;
+            }
+            *segment++ = i;
+            *segment++ = end;
+            i = end;
+        }
+
+        /* If another thread published an index first, use theirs */
+        if (!index.compare_exchange_strong(existing, result,
+            std::memory_order_acq_rel, std::memory_order_acquire)) {
+            delete[] result;
+            return existing;
+        }
+        return result;
+    }
+
+    inline std::string Path::segment(size_t i) const {
+        const uint32_t* segments = offsets();
+        if (i >= segments[0]) {
+            return "";
+        }
+        return path.substr(segments[2 + 2 * i],
+            segments[3 + 2 * i] - segments[2 + 2 * i]);
+    }
+
+    inline Path Path::parent() const {
+        const uint32_t* segments = offsets();
+        if (!segments[1] || (segments[0] == 0 && !is_absolute())) {
+            return Path(*this).up();
+        }
+
+        /* The root is its own parent, and everything else is cut off just
+         * before its last segment */
+        if (segments[0] == 0) {
+            return Path(std::string(1, separator));
+        }
+        return Path(path.substr(0, segments[2 * segments[0]]));
+    }
+
+    inline Path Path::relative_to(const Path& base) const {
+        int kinds = 0;
+        Path a_storage, b_storage;
+        const Path* a = &normalized(*this, false, a_storage, kinds);
+        const Path* b = &normalized(base, false, b_storage, kinds);
+
+        /* Mixing absolute and relative paths, or relative paths with leading
+         * '..'s, can only be compared knowing what they refer to */
+        if ((kinds & KIND_ABSOLUTE && kinds & KIND_RELATIVE) ||
+            kinds & KIND_ESCAPES) {
+            a = &normalized(*this, true, a_storage, kinds);
+            b = &normalized(base, true, b_storage, kinds);
+        }
+
+        const std::string& x(a->path);
+        const std::string& y(b->path);
+        size_t common = common_length(x.data(), x.size(), y.data(), y.size());
+
+        /* Each segment of the base past the common prefix is a level up */
+        size_t ups = 0;
+        for (size_t i = common; i < y.size(); ++i) {
+            if (y[i] != separator && (i == 0 || y[i - 1] == separator)) {
+                ++ups;
+            }
+        }
+
+        size_t rest = common;
+        while (rest < x.size() && x[rest] == separator) {
+            ++rest;
+        }
+
+        std::string result;
+        result.reserve(3 * ups + x.size() - rest);
+        for (size_t i = 0; i < ups; ++i) {
+            result.append("..").push_back(separator);
+        }
+        result.append(x, rest, std::string::npos);
+        return Path(std::move(result));
+    }
+
+    /**************************************************************************
+     * Tests
+     *************************************************************************/
+    inline bool Path::is_absolute() const {
+        return path.size() && path[0] == separator;
+    }
+
+    inline bool Path::trailing_slash() const {
+        return path.size() && path[path.length() - 1] == separator;
+    }
+
+    inline bool Path::exists() const {
+        struct stat buf;
+        if (stat(path.c_str(), &buf) != 0) {
             return false;
         }
         return true;
@@ -539,15 +1536,118 @@ namespace apathy {
         }
     }
 
+    /**************************************************************************
+     * Reading
+     *************************************************************************/
+    inline MappedFile Path::map(int advice, bool populate) const {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return MappedFile();
+        }
+
+        struct stat buf;
+        if (fstat(fd, &buf) != 0 || !S_ISREG(buf.st_mode)) {
+            close(fd);
+            return MappedFile();
+        }
+
+        /* Zero-length mappings aren't allowed, but empty files are fine */
+        if (buf.st_size == 0) {
+            close(fd);
+            return MappedFile(NULL, 0);
+        }
+
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (populate) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void* addr = mmap(NULL, buf.st_size, PROT_READ, flags, fd, 0);
+        /* The mapping holds its own reference to the file */
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return MappedFile();
+        }
+
+        madvise(addr, buf.st_size, advice);
+        return MappedFile(addr, buf.st_size);
+    }
+
+    inline bool Path::read_all(std::string& contents) const {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat buf;
+        if (fstat(fd, &buf) != 0 || S_ISDIR(buf.st_mode)) {
+            close(fd);
+            return false;
+        }
+
+        size_t expected = buf.st_size;
+        /* Some files (like those in /proc) report a size of 0 and return
+         * short reads, and others may change as we read them, so read until
+         * we see the end. The buffer has a byte to spare, so that a file of
+         * the expected size fits without growing it. Once that many bytes
+         * have been read, stop, which saves a read just to find nothing */
+        contents.resize(expected ? expected + 1 : 4096);
+        size_t offset = 0;
+        while (true) {
+            if (offset == contents.size()) {
+                contents.resize(contents.size() * 2);
+            }
+
+            size_t wanted = contents.size() - offset;
+            ssize_t n = pread(fd, &contents[offset], wanted, offset);
+            if (n == 0) {
+                break;
+            } else if (n < 0) {
+                if (errno == EINTR) { continue; }
+                close(fd);
+                contents.clear();
+                return false;
+            }
+            offset += n;
+            if (expected > 0 && offset >= expected) {
+                break;
+            }
+        }
+
+        close(fd);
+        contents.resize(offset);
+        return true;
+    }
+
     /**************************************************************************
      * Static Utility Methods
      *************************************************************************/
     inline Path Path::join(const Path& a, const Path& b) {
-        Path p(a);
+        Path p;
+        p.reserve(a.path.size() + 1 + b.path.size());
+        p.path.append(a.path);
         p.append(b);
         return p;
     }
 
+    inline Path Path::join(std::initializer_list<const Path*> parts) {
+        size_t size = 0;
+        std::initializer_list<const Path*>::const_iterator it(parts.begin());
+        for (; it != parts.end(); ++it) {
+            size += (*it)->path.size() + 1;
+        }
+
+        Path p;
+        p.reserve(size);
+        it = parts.begin();
+        p.path.append((*it)->path);
+        for (++it; it != parts.end(); ++it) {
+            p.append(**it);
+        }
+        return p;
+    }
+
     inline Path Path::join(const std::vector<Segment>& segments) {
         std::string path;
         /* Now, we'll go through the segments, and join them with
@@ -562,6 +1662,160 @@ namespace apathy {
         return Path(path);
     }
 
+    inline bool Path::clean(const std::string& path) {
+        for (size_t i = 0; i < path.size(); ++i) {
+            if (i > 0 && path[i] == separator && path[i - 1] == separator) {
+                return false;
+            }
+
+            /* A segment of '.' or '..' */
+            if (path[i] == '.' && (i == 0 || path[i - 1] == separator)) {
+                size_t end = path.find(separator, i);
+                end = (end == std::string::npos) ? path.size() : end;
+                if (end - i == 1 || (end - i == 2 && path[i + 1] == '.')) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    inline const Path& Path::normalized(const Path& p, bool absolute,
+        Path& storage, int& kinds) {
+        const Path* result = &p;
+        if (absolute && !p.is_absolute()) {
+            storage = p;
+            storage.absolute().sanitize();
+            result = &storage;
+        } else if (!clean(p.path)) {
+            storage = p;
+            storage.sanitize();
+            result = &storage;
+        }
+
+        const std::string& path(result->path);
+        if (result->is_absolute()) {
+            kinds |= KIND_ABSOLUTE;
+        } else {
+            kinds |= KIND_RELATIVE;
+            if (path.compare(0, 2, "..") == 0 &&
+                (path.size() == 2 || path[2] == separator)) {
+                kinds |= KIND_ESCAPES;
+            }
+        }
+        return *result;
+    }
+
+    inline size_t Path::common_length(const char* a, size_t a_size,
+        const char* b, size_t b_size) {
+        size_t limit = std::min(a_size, b_size);
+        size_t m = std::mismatch(a, a + limit, b).first - a;
+
+        /* If both are at the end of a segment, that's the prefix */
+        if ((m == a_size || a[m] == separator) &&
+            (m == b_size || b[m] == separator)) {
+            return m;
+        }
+
+        /* Otherwise, it ends with the last complete segment before that */
+        while (m > 0 && a[m - 1] != separator) {
+            --m;
+        }
+        return m ? m - 1 : 0;
+    }
+
+    template <class F>
+    inline Path Path::common_prefix(size_t n, F at, bool absolute,
+        int& kinds) {
+        Path storage;
+        Path first(normalized(at(0), absolute, storage, kinds));
+        size_t length = first.path.size();
+        for (size_t i = 1; i < n; ++i) {
+            const std::string& path(
+                normalized(at(i), absolute, storage, kinds).path);
+            length = common_length(
+                first.path.data(), length, path.data(), path.size());
+        }
+
+        /* Without a trailing separator, unless it's the root */
+        while (length > 0 && first.path[length - 1] == separator) {
+            --length;
+        }
+        if (length == 0 && first.is_absolute()) {
+            length = 1;
+        }
+        first.path.resize(length);
+        first.forget_index();
+        return first;
+    }
+
+    inline Path Path::common_prefix(const Path& a, const Path& b) {
+        auto at = [&a, &b](size_t i) -> const Path& { return i ? b : a; };
+        int kinds = 0;
+        Path result(common_prefix(2, at, false, kinds));
+        if ((kinds & KIND_ABSOLUTE && kinds & KIND_RELATIVE) ||
+            kinds & KIND_ESCAPES) {
+            result = common_prefix(2, at, true, kinds);
+        }
+        return result;
+    }
+
+    inline Path Path::common_prefix(const std::vector<Path>& paths,
+        size_t threads) {
+        if (paths.empty()) {
+            return Path();
+        }
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        /* Smaller lists aren't worth starting threads for */
+        if (paths.size() < (1 << 16)) {
+            threads = 1;
+        }
+
+        /* Each thread finds the common prefix of a contiguous chunk, and
+         * then the common prefix of those is the answer */
+        std::vector<Path> prefixes(threads);
+        std::vector<int> kinds(threads, 0);
+        auto worker = [&paths, &prefixes, &kinds, threads](size_t i,
+            bool absolute) {
+            size_t begin = paths.size() * i / threads;
+            size_t end = paths.size() * (i + 1) / threads;
+            prefixes[i] = common_prefix(end - begin,
+                [&paths, begin](size_t j) -> const Path& {
+                    return paths[begin + j];
+                }, absolute, kinds[i]);
+        };
+
+        for (int pass = 0; pass < 2; ++pass) {
+            std::vector<std::thread> pool;
+            for (size_t i = 1; i < threads; ++i) {
+                pool.push_back(std::thread(worker, i, pass == 1));
+            }
+            worker(0, pass == 1);
+            for (size_t i = 0; i < pool.size(); ++i) {
+                pool[i].join();
+            }
+
+            /* Mixing absolute and relative paths, or relative paths with
+             * leading '..'s, means starting over with every path absolute */
+            int seen = 0;
+            for (size_t i = 0; i < threads; ++i) {
+                seen |= kinds[i];
+            }
+            if (pass == 1 || !((seen & KIND_ABSOLUTE &&
+                seen & KIND_RELATIVE) || seen & KIND_ESCAPES)) {
+                break;
+            }
+        }
+
+        int ignored = 0;
+        return common_prefix(threads, [&prefixes](size_t i) -> const Path& {
+            return prefixes[i];
+        }, false, ignored);
+    }
+
     inline Path Path::cwd() {
         Path p;
 
@@ -620,6 +1874,505 @@ namespace apathy {
         return true;
     }
 
+    inline std::string Path::dirname() const {
+        size_t pos = path.find_last_not_of(separator);
+        pos = (pos == std::string::npos) ? 0 : path.rfind(separator, pos);
+        if (pos == std::string::npos) {
+            return ".";
+        }
+
+        /* Skip over any run of separators */
+        size_t end = path.find_last_not_of(separator, pos);
+        if (end == std::string::npos) {
+            return std::string(1, separator);
+        }
+        return path.substr(0, end + 1);
+    }
+
+    inline std::string Path::temp_name() const {
+        static std::atomic<unsigned long> counter(0);
+        return path + ".tmp." + std::to_string(getpid()) + "." +
+            std::to_string(counter++);
+    }
+
+    inline bool Path::write_fd(int fd, const std::string& contents) {
+        for (size_t written = 0; written < contents.size();) {
+            ssize_t n = write(fd, contents.data() + written,
+                contents.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    inline bool Path::write_temp(const Path& p, const std::string& contents,
+        SyncPolicy sync, mode_t mode, std::string& temp) {
+        int fd = -1;
+        std::string name;
+        for (int attempt = 0; fd == -1 && attempt < 100; ++attempt) {
+            name = p.temp_name();
+            fd = open(name.c_str(),
+                O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+            if (fd == -1 && errno != EEXIST) {
+                return false;
+            }
+        }
+
+        if (fd == -1) {
+            return false;
+        }
+
+        bool result = write_fd(fd, contents) &&
+            (sync == SYNC_NONE || fdatasync(fd) == 0);
+        if (close(fd) != 0) {
+            result = false;
+        }
+
+        if (!result) {
+            unlink(name.c_str());
+            return false;
+        }
+        temp = name;
+        return true;
+    }
+
+    inline bool Path::sync_directory(const std::string& dir) {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        bool result = (fsync(fd) == 0);
+        close(fd);
+        return result;
+    }
+
+    inline bool Path::copy_fd(int in, int out, const struct stat& st,
+        int options) {
+        bool done = false;
+#ifdef __linux__
+#ifdef FICLONE
+        /* A reflink shares the underlying extents, so no data is moved at
+         * all. Only some filesystems (btrfs, xfs, ...) support it */
+        done = (ioctl(out, FICLONE, in) == 0);
+#endif
+        /* copy_file_range and sendfile both advance the file offsets, so if
+         * either gives up partway we can pick up where it left off. Errors
+         * other than 'not supported here' are fatal */
+        while (!done) {
+            ssize_t n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+            if (n > 0) {
+                continue;
+            } else if (n == 0) {
+                done = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EXDEV || errno == ENOSYS ||
+                errno == EINVAL || errno == EOPNOTSUPP) {
+                break;
+            } else {
+                return false;
+            }
+        }
+
+        while (!done) {
+            ssize_t n = sendfile(out, in, NULL, 1 << 30);
+            if (n > 0) {
+                continue;
+            } else if (n == 0) {
+                done = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOSYS || errno == EINVAL) {
+                break;
+            } else {
+                return false;
+            }
+        }
+#endif
+        if (!done) {
+            /* Fall back to copying through a large buffer */
+            std::vector<char> buffer(1 << 20);
+            while (true) {
+                ssize_t n = read(in, &buffer[0], buffer.size());
+                if (n == 0) {
+                    break;
+                } else if (n < 0) {
+                    if (errno == EINTR) { continue; }
+                    return false;
+                }
+
+                for (ssize_t written = 0; written < n;) {
+                    ssize_t w = write(out, &buffer[written], n - written);
+                    if (w < 0) {
+                        if (errno == EINTR) { continue; }
+                        return false;
+                    }
+                    written += w;
+                }
+            }
+        }
+
+        /* The mode we opened with is subject to the umask */
+        if ((options & COPY_MODE) && fchmod(out, st.st_mode & 07777) != 0) {
+            return false;
+        }
+
+        if (options & COPY_TIMES) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            if (futimens(out, times) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool Path::copy(const Path& source, const Path& dest,
+        int options) {
+        int in = open(source.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(in);
+            return false;
+        }
+
+        /* Truncating the destination would destroy the source if they're
+         * the same file */
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        if (options & COPY_OVERWRITE) {
+            struct stat existing;
+            if (stat(dest.path.c_str(), &existing) == 0 &&
+                existing.st_dev == st.st_dev && existing.st_ino == st.st_ino) {
+                close(in);
+                return false;
+            }
+        } else {
+            flags |= O_EXCL;
+        }
+
+        int out = open(dest.path.c_str(), flags, st.st_mode & 07777);
+        if (out == -1) {
+            close(in);
+            return false;
+        }
+
+        bool result = copy_fd(in, out, st, options);
+        if (close(out) != 0) {
+            result = false;
+        }
+        close(in);
+
+        /* Don't leave a partial copy behind */
+        if (!result) {
+            unlink(dest.path.c_str());
+        }
+        return result;
+    }
+
+    inline bool Path::copytree_dirs(const Path& source, const Path& dest,
+        int options, std::vector<std::pair<Path, Path> >& files,
+        std::vector<std::pair<Path, struct stat> >& dirs) {
+        struct stat st;
+        if (stat(source.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return false;
+        }
+
+        if (mkdir(dest.path.c_str(), st.st_mode & 07777) != 0) {
+            if (errno != EEXIST || !(options & COPY_OVERWRITE) ||
+                !dest.is_directory()) {
+                return false;
+            }
+        }
+        if ((options & COPY_MODE) && chmod(dest.path.c_str(),
+            st.st_mode & 07777) != 0) {
+            return false;
+        }
+        dirs.push_back(std::make_pair(dest, st));
+
+        std::vector<Path> children(listdir(source));
+        std::vector<Path>::iterator it(children.begin());
+        for (; it != children.end(); ++it) {
+            Path target(dest);
+            target.append(it->filename());
+
+            struct stat child;
+            if (lstat(it->path.c_str(), &child) != 0) {
+                return false;
+            }
+
+            if (S_ISDIR(child.st_mode)) {
+                if (!copytree_dirs(*it, target, options, files, dirs)) {
+                    return false;
+                }
+            } else if (S_ISREG(child.st_mode)) {
+                files.push_back(std::make_pair(*it, target));
+            } else if (S_ISLNK(child.st_mode)) {
+                std::string link(child.st_size + 1, '\0');
+                ssize_t n = readlink(it->path.c_str(), &link[0], link.size());
+                if (n < 0) {
+                    return false;
+                }
+                link.resize(n);
+                if ((options & COPY_OVERWRITE) && target.exists()) {
+                    unlink(target.path.c_str());
+                }
+                if (symlink(link.c_str(), target.path.c_str()) != 0) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    inline bool Path::copytree(const Path& source, const Path& dest,
+        int options, size_t threads) {
+        std::vector<std::pair<Path, Path> > files;
+        std::vector<std::pair<Path, struct stat> > dirs;
+        if (!copytree_dirs(source, dest, options, files, dirs)) {
+            return false;
+        }
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = std::min(threads, files.size());
+
+        /* Each thread takes the next uncopied file until none are left */
+        std::atomic<size_t> next(0);
+        std::atomic<bool> result(true);
+        auto worker = [&]() {
+            for (size_t i = next++; i < files.size(); i = next++) {
+                if (!copy(files[i].first, files[i].second, options)) {
+                    result = false;
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.push_back(std::thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < pool.size(); ++i) {
+            pool[i].join();
+        }
+
+        /* Populating a directory changes its times, so they're set last,
+         * deepest first */
+        if (options & COPY_TIMES) {
+            std::vector<std::pair<Path, struct stat> >::reverse_iterator it;
+            for (it = dirs.rbegin(); it != dirs.rend(); ++it) {
+                struct timespec times[2] = {
+                    it->second.st_atim, it->second.st_mtim };
+                if (utimensat(AT_FDCWD, it->first.path.c_str(), times, 0)) {
+                    result = false;
+                }
+            }
+        }
+        return result;
+    }
+
+    struct Path::TreeWalk {
+        TreeWalk(size_t threads, bool one_filesystem, dev_t device):
+            mutex(), ready(), queue(), pending(0), threads(threads),
+            one_filesystem(one_filesystem), device(device), shards() {}
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        /* Directories waiting for a thread, with their depths */
+        std::vector<std::pair<int, size_t> > queue;
+        /* Directories queued or being read. When this reaches 0, we're
+         * done */
+        size_t pending;
+        size_t threads;
+        bool one_filesystem;
+        dev_t device;
+
+        /* Inodes with several links that have already been counted. These
+         * are split up to keep threads from contending */
+        typedef std::pair<dev_t, ino_t> Inode;
+        struct InodeHash {
+            size_t operator()(const Inode& inode) const {
+                return std::hash<unsigned long long>()(
+                    inode.second * 0x9E3779B97F4A7C15ULL ^ inode.first);
+            }
+        };
+        struct Shard {
+            Shard(): mutex(), seen() {}
+
+            std::mutex mutex;
+            std::unordered_set<Inode, InodeHash> seen;
+        };
+        Shard shards[64];
+
+        /* Is this the first time we've seen this inode? */
+        bool first_link(const struct stat& buf) {
+            Inode inode(buf.st_dev, buf.st_ino);
+            Shard& shard(shards[InodeHash()(inode) % 64]);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            return shard.seen.insert(inode).second;
+        }
+    };
+
+    inline void Path::tree_count(TreeStats& stats, const struct stat& buf,
+        size_t depth) {
+        if (stats.entries_by_depth.size() <= depth) {
+            stats.entries_by_depth.resize(depth + 1, 0);
+            stats.bytes_by_depth.resize(depth + 1, 0);
+        }
+
+        stats.bytes += buf.st_size;
+        stats.allocated += buf.st_blocks * 512ULL;
+        stats.entries_by_depth[depth] += 1;
+        stats.bytes_by_depth[depth] += buf.st_size;
+        if (S_ISREG(buf.st_mode)) {
+            ++stats.files;
+        } else if (S_ISDIR(buf.st_mode)) {
+            ++stats.directories;
+        } else if (S_ISLNK(buf.st_mode)) {
+            ++stats.symlinks;
+        } else {
+            ++stats.others;
+        }
+    }
+
+    inline void Path::tree_stats(TreeWalk& walk, int dir, size_t depth,
+        TreeStats& stats) {
+        DIR* listing = fdopendir(dir);
+        if (listing == NULL) {
+            close(dir);
+            return;
+        }
+
+        for (dirent* ent = readdir(listing); ent != NULL;
+            ent = readdir(listing)) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                continue;
+            }
+
+            struct stat buf;
+            if (fstatat(dir, ent->d_name, &buf, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+
+            if (!S_ISDIR(buf.st_mode)) {
+                if (buf.st_nlink < 2 || walk.first_link(buf)) {
+                    tree_count(stats, buf, depth + 1);
+                }
+                continue;
+            }
+
+            if (walk.one_filesystem && buf.st_dev != walk.device) {
+                continue;
+            }
+            tree_count(stats, buf, depth + 1);
+
+            int child = openat(dir, ent->d_name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child == -1) {
+                continue;
+            }
+
+            /* Give the directory to another thread if there's any chance
+             * one is idle, and otherwise read it ourselves. This bounds the
+             * number of directories open at once */
+            {
+                std::lock_guard<std::mutex> lock(walk.mutex);
+                if (walk.queue.size() < walk.threads) {
+                    walk.queue.push_back(std::make_pair(child, depth + 1));
+                    ++walk.pending;
+                    walk.ready.notify_one();
+                    child = -1;
+                }
+            }
+            if (child != -1) {
+                tree_stats(walk, child, depth + 1, stats);
+            }
+        }
+
+        /* This closes dir as well */
+        closedir(listing);
+    }
+
+    inline Path::TreeStats Path::tree_stats(const Path& root,
+        bool one_filesystem, size_t threads) {
+        TreeStats result;
+        int dir = open(root.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct stat buf;
+        if (dir == -1) {
+            return result;
+        } else if (fstat(dir, &buf) != 0) {
+            close(dir);
+            return result;
+        }
+        tree_count(result, buf, 0);
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        TreeWalk walk(threads, one_filesystem, buf.st_dev);
+        walk.queue.push_back(std::make_pair(dir, 0));
+        walk.pending = 1;
+
+        std::mutex merging;
+        auto worker = [&]() {
+            TreeStats stats;
+            std::unique_lock<std::mutex> lock(walk.mutex);
+            while (true) {
+                walk.ready.wait(lock, [&]() {
+                    return !walk.queue.empty() || walk.pending == 0;
+                });
+                if (walk.queue.empty()) {
+                    break;
+                }
+
+                std::pair<int, size_t> next(walk.queue.back());
+                walk.queue.pop_back();
+                lock.unlock();
+                tree_stats(walk, next.first, next.second, stats);
+                lock.lock();
+                if (--walk.pending == 0) {
+                    walk.ready.notify_all();
+                }
+            }
+            lock.unlock();
+
+            /* Add this thread's totals to the result */
+            std::lock_guard<std::mutex> merge(merging);
+            result.bytes += stats.bytes;
+            result.allocated += stats.allocated;
+            result.files += stats.files;
+            result.directories += stats.directories;
+            result.symlinks += stats.symlinks;
+            result.others += stats.others;
+            size_t depths = stats.entries_by_depth.size();
+            if (result.entries_by_depth.size() < depths) {
+                result.entries_by_depth.resize(depths, 0);
+                result.bytes_by_depth.resize(depths, 0);
+            }
+            for (size_t i = 0; i < depths; ++i) {
+                result.entries_by_depth[i] += stats.entries_by_depth[i];
+                result.bytes_by_depth[i] += stats.bytes_by_depth[i];
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.push_back(std::thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < pool.size(); ++i) {
+            pool[i].join();
+        }
+        return result;
+    }
+
     inline bool Path::makedirs(const Path& p, mode_t mode) {
         /* We need to make a copy of the path, that's an absolute path */
         Path abs = Path(p).absolute();
@@ -692,10 +2445,13 @@ namespace apathy {
             return results;
         }
 
+        /* Each entry is the base, a separator and the name, built in a
+         * string of exactly that size */
+        base.directory();
+        const std::string& prefix(base.string());
+
         /* Otherwise, go through everything */
         for (dirent* ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
-            Path cpy(base);
-
             /* Skip the parent directory listing */
             if (!strcmp(ent->d_name, "..")) {
                 continue;
@@ -706,8 +2462,11 @@ namespace apathy {
                 continue;
             }
 
-            cpy.relative(ent->d_name);
-            results.push_back(cpy);
+            size_t length = strlen(ent->d_name);
+            std::string entry;
+            entry.reserve(prefix.size() + length);
+            entry.append(prefix).append(ent->d_name, length);
+            results.push_back(Path(std::move(entry)));
         }
 
         errno = 0;
@@ -715,6 +2474,108 @@ namespace apathy {
         return results;
     }
 
+    inline bool Path::write_all(const Path& p, const std::string& contents,
+        mode_t mode) {
+        int fd = open(p.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            mode);
+        if (fd == -1) {
+            return false;
+        }
+
+        if (!write_fd(fd, contents)) {
+            close(fd);
+            return false;
+        }
+        return close(fd) == 0;
+    }
+
+    inline bool Path::atomic_write(const Path& p,
+        const std::string& contents, SyncPolicy sync, mode_t mode) {
+        std::string dir(p.dirname());
+        std::string temp;
+#ifdef O_TMPFILE
+        /* An anonymous file never leaves anything behind if we fail before
+         * it's given a name. Not every filesystem supports them */
+        int fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+        if (fd != -1) {
+            bool written = write_fd(fd, contents) &&
+                (sync == SYNC_NONE || fdatasync(fd) == 0);
+
+            /* Linking through /proc doesn't require any privileges, unlike
+             * AT_EMPTY_PATH. The link can't replace the destination, so it
+             * gets a temporary name first */
+            std::string proc("/proc/self/fd/" + std::to_string(fd));
+            for (int attempt = 0; written && attempt < 100; ++attempt) {
+                std::string name(p.temp_name());
+                if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, name.c_str(),
+                    AT_SYMLINK_FOLLOW) == 0) {
+                    temp = name;
+                    break;
+                } else if (errno != EEXIST) {
+                    break;
+                }
+            }
+            close(fd);
+            if (!written) {
+                return false;
+            }
+        }
+#endif
+        if (temp.empty() && !write_temp(p, contents, sync, mode, temp)) {
+            return false;
+        }
+
+        if (rename(temp.c_str(), p.path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
+        }
+
+        return sync != SYNC_FULL || sync_directory(dir);
+    }
+
+    inline bool WriteBatch::add(const Path& p, const std::string& contents,
+        mode_t mode) {
+        std::string temp;
+        if (!Path::write_temp(p, contents, sync, mode, temp)) {
+            return false;
+        }
+        pending.push_back(std::make_pair(temp, p));
+        return true;
+    }
+
+    inline bool WriteBatch::commit() {
+        bool result = true;
+        std::vector<std::string> dirs;
+        std::vector<std::pair<std::string, Path> >::iterator it;
+        for (it = pending.begin(); it != pending.end(); ++it) {
+            if (rename(it->first.c_str(), it->second.path.c_str()) != 0) {
+                unlink(it->first.c_str());
+                result = false;
+            } else if (sync == Path::SYNC_FULL) {
+                dirs.push_back(it->second.dirname());
+            }
+        }
+        pending.clear();
+
+        /* Each directory only needs to be flushed once */
+        std::sort(dirs.begin(), dirs.end());
+        dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+        for (size_t i = 0; i < dirs.size(); ++i) {
+            if (!Path::sync_directory(dirs[i])) {
+                result = false;
+            }
+        }
+        return result;
+    }
+
+    inline void WriteBatch::discard() {
+        std::vector<std::pair<std::string, Path> >::iterator it;
+        for (it = pending.begin(); it != pending.end(); ++it) {
+            unlink(it->first.c_str());
+        }
+        pending.clear();
+    }
+
     inline std::vector<Path> Path::glob(const std::string& pattern) {
         /* First, we need a glob_t, and then we'll look at the results */
         glob_t globbuf;
@@ -729,6 +2590,377 @@ namespace apathy {
         }
         return results;
     }
+
+    /**************************************************************************
+     * Directory
+     *************************************************************************/
+    inline Directory::Directory(const Path& p): fd(-1), base(p) {
+        fd = ::open(p.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    inline Directory& Directory::operator=(Directory&& other) {
+        if (this != &other) {
+            close();
+            fd = other.fd;
+            base = std::move(other.base);
+            other.fd = -1;
+        }
+        return *this;
+    }
+
+    inline void Directory::close() {
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    inline Directory Directory::open(const Path& rel) const {
+        int child = ::openat(fd, rel.string().c_str(),
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child == -1) {
+            return Directory();
+        }
+        return Directory(child, Path(base).relative(rel));
+    }
+
+    inline bool Directory::stat(const Path& rel, struct stat& buf,
+        bool follow) const {
+        return ::fstatat(fd, rel.string().c_str(), &buf,
+            follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    inline bool Directory::exists(const Path& rel) const {
+        struct stat buf;
+        return stat(rel, buf);
+    }
+
+    inline bool Directory::is_file(const Path& rel) const {
+        struct stat buf;
+        return stat(rel, buf) && S_ISREG(buf.st_mode);
+    }
+
+    inline bool Directory::is_directory(const Path& rel) const {
+        struct stat buf;
+        return stat(rel, buf) && S_ISDIR(buf.st_mode);
+    }
+
+    inline bool Directory::touch(const Path& rel, mode_t mode) const {
+        int file = ::openat(fd, rel.string().c_str(),
+            O_RDONLY | O_CREAT | O_CLOEXEC, mode);
+        if (file == -1) {
+            makedirs(Path(rel.dirname()));
+            file = ::openat(fd, rel.string().c_str(),
+                O_RDONLY | O_CREAT | O_CLOEXEC, mode);
+            if (file == -1) {
+                return false;
+            }
+        }
+
+        if (::close(file) == -1) {
+            perror("touch close");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool Directory::makedirs(const Path& rel, mode_t mode) const {
+        /* Walk down from here (or from the root, for absolute paths) a
+         * segment at a time, making whatever's missing */
+        int current = rel.is_absolute() ? ::open(
+            "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : fd;
+        std::vector<Path::Segment> segments(rel.split());
+        bool result = (current != -1);
+        for (size_t i = 0; result && i < segments.size(); ++i) {
+            const std::string& name(segments[i].segment);
+            if (name.empty() || name == ".") {
+                continue;
+            }
+
+            if (::mkdirat(current, name.c_str(), mode) != 0 &&
+                errno != EEXIST) {
+                perror("makedirs");
+                result = false;
+                break;
+            }
+
+            int next = ::openat(current, name.c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (current != fd) {
+                ::close(current);
+            }
+            current = next;
+            result = (current != -1);
+        }
+
+        if (current != -1 && current != fd) {
+            ::close(current);
+        }
+        errno = 0;
+        return result;
+    }
+
+    inline bool Directory::move(const Path& source, const Path& dest,
+        bool mkdirs) const {
+        if (::renameat(fd, source.string().c_str(),
+            fd, dest.string().c_str()) == 0) {
+            return true;
+        }
+
+        if (errno == ENOENT && mkdirs) {
+            makedirs(Path(dest.dirname()));
+            return ::renameat(fd, source.string().c_str(),
+                fd, dest.string().c_str()) == 0;
+        }
+        return false;
+    }
+
+    inline bool Directory::move_to(const Path& source, const Directory& to,
+        const Path& dest) const {
+        return ::renameat(fd, source.string().c_str(),
+            to.fd, dest.string().c_str()) == 0;
+    }
+
+    inline bool Directory::rm(const Path& rel) const {
+        /* Like remove(3), this removes either files or directories */
+        if (::unlinkat(fd, rel.string().c_str(), 0) == 0) {
+            return true;
+        }
+        if ((errno == EISDIR || errno == EPERM) &&
+            ::unlinkat(fd, rel.string().c_str(), AT_REMOVEDIR) == 0) {
+            return true;
+        }
+        perror("Remove");
+        return false;
+    }
+
+    inline std::vector<Path> Directory::listdir() const {
+        std::vector<Path> results;
+        /* The DIR takes ownership of its descriptor and advances its
+         * offset, so reopen the directory rather than dup(2) ours, which
+         * would share the offset with every other copy */
+        int copy = ::openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR* dir = (copy == -1) ? NULL : fdopendir(copy);
+        if (dir == NULL) {
+            if (copy != -1) {
+                ::close(copy);
+            }
+            return results;
+        }
+
+        for (dirent* ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                continue;
+            }
+            results.push_back(Path(std::string(ent->d_name)));
+        }
+
+        errno = 0;
+        closedir(dir);
+        return results;
+    }
+
+    inline void Directory::glob(int dir, const std::string& prefix,
+        const std::vector<std::string>& segments, size_t index,
+        std::vector<Path>& results) {
+        const std::string& pattern(segments[index]);
+        bool last = (index + 1 == segments.size());
+
+        /* Segments without wildcards don't require a listing */
+        std::vector<std::string> names;
+        if (pattern.find_first_of("*?[\\") == std::string::npos) {
+            struct stat buf;
+            if (::fstatat(dir, pattern.c_str(), &buf, 0) == 0) {
+                names.push_back(pattern);
+            }
+        } else {
+            Directory listing(::dup(dir), Path());
+            std::vector<Path> children(listing.listdir());
+            for (size_t i = 0; i < children.size(); ++i) {
+                if (fnmatch(pattern.c_str(), children[i].string().c_str(),
+                    FNM_PERIOD) == 0) {
+                    names.push_back(children[i].string());
+                }
+            }
+        }
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            std::string path(prefix.empty() ? names[i] :
+                prefix + Path::separator + names[i]);
+            if (last) {
+                results.push_back(Path(path));
+                continue;
+            }
+
+            int child = ::openat(dir, names[i].c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child != -1) {
+                glob(child, path, segments, index + 1, results);
+                ::close(child);
+            }
+        }
+    }
+
+    inline std::vector<Path> Directory::glob(
+        const std::string& pattern) const {
+        std::vector<std::string> segments;
+        std::stringstream stream(pattern);
+        for (Path::Segment s; stream >> s;) {
+            if (!s.segment.empty()) {
+                segments.push_back(s.segment);
+            }
+        }
+
+        std::vector<Path> results;
+        if (segments.empty()) {
+            return results;
+        }
+
+        if (pattern[0] == Path::separator) {
+            int root = ::open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (root != -1) {
+                glob(root, "", segments, 0, results);
+                ::close(root);
+            }
+            for (size_t i = 0; i < results.size(); ++i) {
+                results[i] = Path(std::string(1, Path::separator) +
+                    results[i].string());
+            }
+        } else {
+            glob(fd, "", segments, 0, results);
+        }
+
+        std::sort(results.begin(), results.end(),
+            [](const Path& a, const Path& b) {
+                return a.string() < b.string();
+            });
+        return results;
+    }
+
+    /**************************************************************************
+     * Bulk creation
+     *************************************************************************/
+    inline void Path::create_in(int dir, const std::vector<FileSpec>& files,
+        const std::vector<size_t>& order, size_t begin, size_t end,
+        std::vector<int>& results) {
+        for (size_t i = begin; i < end; ++i) {
+            const FileSpec& file(files[order[i]]);
+            const std::string& path(file.path.path);
+            size_t pos = path.rfind(separator);
+            std::string name(pos == std::string::npos ?
+                path : path.substr(pos + 1));
+
+            int flags = (file.size > 0 ? O_WRONLY : O_RDONLY) |
+                O_CREAT | O_CLOEXEC;
+            int fd = ::openat(dir, name.c_str(), flags, file.mode);
+            if (fd == -1) {
+                results[order[i]] = errno;
+                continue;
+            }
+
+            int error = 0;
+            if (file.size > 0) {
+#ifdef __linux__
+                if (::fallocate(fd, 0, 0, file.size) != 0) {
+                    error = errno;
+                }
+#else
+                error = EOPNOTSUPP;
+#endif
+                /* Filesystems that can't preallocate get a sparse file of
+                 * the right size instead */
+                if (error == EOPNOTSUPP || error == ENOSYS) {
+                    struct stat buf;
+                    error = 0;
+                    if (::fstat(fd, &buf) != 0) {
+                        error = errno;
+                    } else if (buf.st_size < file.size &&
+                        ::ftruncate(fd, file.size) != 0) {
+                        error = errno;
+                    }
+                }
+            }
+
+            if (::close(fd) != 0 && error == 0) {
+                error = errno;
+            }
+            results[order[i]] = error;
+        }
+    }
+
+    inline std::vector<int> Path::create(const std::vector<FileSpec>& files,
+        size_t threads) {
+        std::vector<int> results(files.size(), 0);
+
+        /* Group the files by directory */
+        std::vector<std::string> dirs(files.size());
+        std::vector<size_t> order(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            dirs[i] = files[i].path.dirname();
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(),
+            [&dirs](size_t a, size_t b) { return dirs[a] < dirs[b]; });
+
+        /* Each unit of work is a run of up to `chunk` files in the same
+         * directory, so that large directories are split between threads */
+        const size_t chunk = 256;
+        std::vector<std::pair<size_t, size_t> > work;
+        for (size_t begin = 0, end; begin < order.size(); begin = end) {
+            end = begin + 1;
+            while (end < order.size() && end - begin < chunk &&
+                dirs[order[end]] == dirs[order[begin]]) {
+                ++end;
+            }
+            work.push_back(std::make_pair(begin, end));
+        }
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = std::max<size_t>(1, std::min(threads, work.size()));
+
+        /* Directories are only made when they can't be opened, one at a
+         * time so that makedirs doesn't race with itself */
+        std::mutex making;
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < work.size(); i = next++) {
+                size_t begin = work[i].first, end = work[i].second;
+                const std::string& dir(dirs[order[begin]]);
+                /* Take errno as soon as each open fails, before anything
+                 * else has a chance to change it */
+                Directory directory((Path(dir)));
+                int error = directory.valid() ? 0 : errno;
+                if (error == ENOENT) {
+                    std::lock_guard<std::mutex> lock(making);
+                    makedirs(dir);
+                    Directory made((Path(dir)));
+                    error = made.valid() ? 0 : errno;
+                    directory = std::move(made);
+                }
+
+                if (error != 0) {
+                    for (size_t j = begin; j < end; ++j) {
+                        results[order[j]] = error;
+                    }
+                    continue;
+                }
+                create_in(directory.descriptor(), files, order, begin, end,
+                    results);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.push_back(std::thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < pool.size(); ++i) {
+            pool[i].join();
+        }
+        return results;
+    }
 }
 
 #endif
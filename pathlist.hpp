@@ -0,0 +1,549 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef APATHY__PATHLIST_HPP
+#define APATHY__PATHLIST_HPP
+
+/* C++ includes */
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+/* C includes */
+#include <stdint.h>
+
+/* Internal libraries */
+#include "path.hpp"
+
+namespace apathy {
+    /* A reference to a path stored elsewhere, valid as long as that storage
+     * is. Used to read paths out of a PathList without copying them */
+    class PathView {
+    public:
+        PathView(): ptr(NULL), length(0) {}
+        PathView(const char* data, size_t size): ptr(data), length(size) {}
+        PathView(const PathView& other) = default;
+        PathView& operator=(const PathView& other) = default;
+
+        const char* data() const { return ptr; }
+        size_t size() const { return length; }
+        bool empty() const { return length == 0; }
+
+        /* Copy the path out */
+        std::string string() const { return std::string(ptr, length); }
+        Path path() const { return Path(string()); }
+
+        bool operator==(const PathView& other) const {
+            return length == other.length &&
+                (length == 0 || memcmp(ptr, other.ptr, length) == 0);
+        }
+        bool operator!=(const PathView& other) const {
+            return !(*this == other);
+        }
+
+        friend std::ostream& operator<<(std::ostream& stream,
+            const PathView& p) {
+            return stream.write(p.ptr, p.length);
+        }
+
+    private:
+        const char* ptr;
+        size_t length;
+    };
+
+    /* Path lists are a compact binary format for long lists of paths
+     *
+     * Each path is stored as the length of the prefix it shares with the
+     * previous path, followed by the rest of it. For sorted lists, where
+     * neighbors share most of their directories, this is a fraction of the
+     * size of the paths joined by newlines. Every `block_size` paths, a path
+     * is stored in full, so reading can start at any block. An optional
+     * index of where each block starts allows jumping straight to one.
+     *
+     * The layout is:
+     *
+     *   header: "APLIST1\0", version (u32), block size (u32)
+     *   paths:  varint(shared + 1), varint(suffix length), suffix
+     *   end:    varint(0)
+     *   index:  the offset of each block (u64), if indexed
+     *   footer: count (u64), blocks (u64), index offset or 0 (u64),
+     *           "APLIST1\0"
+     *
+     * Integers are little-endian on little-endian machines; the format is
+     * not meant to move between machines of different endianness */
+    namespace pathlist {
+        const char magic[8] = { 'A', 'P', 'L', 'I', 'S', 'T', '1', '\0' };
+        const uint32_t version = 1;
+        const size_t header_size = 16;
+        const size_t footer_size = 32;
+    }
+
+    /* Writes a path list to a stream as paths are added */
+    class PathListWriter {
+    public:
+        /* @param out - stream to write to
+         * @param block_size - how often to store a path in full
+         * @param index - whether to write an index of blocks */
+        PathListWriter(std::ostream& out, uint32_t block_size=64,
+            bool index=true);
+
+        /* Finishes the list, if it hasn't been already */
+        ~PathListWriter() { finish(); }
+
+        /* Add the next path. Sorted lists compress best */
+        bool add(const Path& path) { return add(path.string()); }
+        bool add(const std::string& path);
+
+        /* Write the index and footer. Nothing may be added afterwards */
+        bool finish();
+
+        /* The number of paths added */
+        size_t size() const { return count; }
+
+        /* Write a list of paths to a file
+         *
+         * @param file - path to write to
+         * @param paths - the paths to write
+         * @param block_size - how often to store a path in full */
+        static bool save(const Path& file, const std::vector<Path>& paths,
+            uint32_t block_size=64);
+
+    private:
+        PathListWriter(const PathListWriter& other) = delete;
+        PathListWriter& operator=(const PathListWriter& other) = delete;
+
+        void put(const void* data, size_t size);
+        void varint(uint64_t value);
+        void fixed(uint64_t value) { put(&value, sizeof(value)); }
+
+        std::ostream& out;
+        uint32_t block_size;
+        bool indexed;
+        bool finished;
+        /* Paths written so far */
+        uint64_t count;
+        /* Bytes written so far */
+        uint64_t offset;
+        /* The last path written */
+        std::string previous;
+        /* Where each block starts */
+        std::vector<uint64_t> blocks;
+    };
+
+    /* Reads a path list from memory, or a mapped file
+     *
+     * Paths are read in order with `next`, which provides a view of the path
+     * that's valid until the next call, so nothing is allocated per path.
+     * With an index, `seek` jumps to the start of any block */
+    class PathListReader {
+    public:
+        /* Read a path list that's already in memory. The memory must outlive
+         * the reader */
+        PathListReader(const char* data, size_t size);
+
+        /* Map and read a path list file */
+        explicit PathListReader(const Path& file);
+
+        /* Is this a well-formed path list? */
+        bool valid() const { return good; }
+
+        /* The number of paths in the list */
+        size_t size() const { return count; }
+
+        /* How many blocks there are, and how many paths are in each */
+        size_t blocks() const { return block_count; }
+        size_t block_size() const { return paths_per_block; }
+
+        /* Does the list have an index, so that `seek` works? */
+        bool indexed() const { return index_offset != 0; }
+
+        /* Continue reading from the start of a block
+         *
+         * @returns false if there's no index, or no such block */
+        bool seek(size_t block);
+
+        /* Read the next path
+         *
+         * @param view - set to the path, valid until the next call
+         * @returns false at the end of the list, or if it's malformed */
+        bool next(PathView& view);
+
+        /* Read a whole path list file
+         *
+         * This is bound by allocating each Path, rather than by decoding, so
+         * prefer `next` where the paths don't need to outlive the reader
+         *
+         * @param file - path list to read
+         * @param paths - the paths are appended to this */
+        static bool load(const Path& file, std::vector<Path>& paths);
+
+    private:
+        PathListReader(const PathListReader& other) = delete;
+        PathListReader& operator=(const PathListReader& other) = delete;
+
+        /* Check the header and footer */
+        void open();
+
+        /* Read a varint at position, advancing it */
+        bool varint(uint64_t& value);
+
+        /* Read a fixed-size integer at an offset */
+        uint64_t fixed(size_t at) const;
+
+        const char* data() const {
+            return mapped.valid() ? mapped.data() : external;
+        }
+
+        /* The list, either mapped or in someone else's memory */
+        MappedFile mapped;
+        const char* external;
+        size_t length;
+        bool good;
+        /* From the footer */
+        size_t count;
+        size_t block_count;
+        size_t paths_per_block;
+        size_t index_offset;
+        /* Where the paths end */
+        size_t end;
+        /* Where the next path is */
+        size_t position;
+        /* The path most recently read */
+        std::string current;
+    };
+
+    /* Reads a path list from a stream, such as a pipe, in order */
+    class PathListDecoder {
+    public:
+        explicit PathListDecoder(std::istream& in);
+
+        /* Is the stream a well-formed path list, so far? */
+        bool valid() const { return good; }
+
+        /* Read the next path
+         *
+         * @param view - set to the path, valid until the next call
+         * @returns false at the end of the list, or if it's malformed */
+        bool next(PathView& view);
+
+    private:
+        PathListDecoder(const PathListDecoder& other) = delete;
+        PathListDecoder& operator=(const PathListDecoder& other) = delete;
+
+        bool varint(uint64_t& value);
+
+        std::istream& in;
+        bool good;
+        /* Whether the end of the list has been read */
+        bool done;
+        std::string current;
+    };
+
+    /**************************************************************************
+     * PathListWriter
+     *************************************************************************/
+    inline PathListWriter::PathListWriter(std::ostream& out,
+        uint32_t block_size, bool index): out(out),
+        block_size(block_size ? block_size : 1), indexed(index),
+        finished(false), count(0), offset(0), previous(), blocks() {
+        uint32_t version = pathlist::version;
+        put(pathlist::magic, sizeof(pathlist::magic));
+        put(&version, sizeof(version));
+        put(&this->block_size, sizeof(this->block_size));
+    }
+
+    inline void PathListWriter::put(const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), size);
+        offset += size;
+    }
+
+    inline void PathListWriter::varint(uint64_t value) {
+        char buffer[10];
+        size_t size = 0;
+        while (value >= 0x80) {
+            buffer[size++] = static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        buffer[size++] = static_cast<char>(value);
+        put(buffer, size);
+    }
+
+    inline bool PathListWriter::add(const std::string& path) {
+        if (finished) {
+            return false;
+        }
+
+        size_t shared = 0;
+        if (count % block_size == 0) {
+            blocks.push_back(offset);
+        } else {
+            size_t limit = std::min(previous.size(), path.size());
+            while (shared < limit && previous[shared] == path[shared]) {
+                ++shared;
+            }
+        }
+
+        varint(shared + 1);
+        varint(path.size() - shared);
+        put(path.data() + shared, path.size() - shared);
+        previous = path;
+        ++count;
+        return out.good();
+    }
+
+    inline bool PathListWriter::finish() {
+        if (finished) {
+            return out.good();
+        }
+        finished = true;
+
+        varint(0);
+        uint64_t index = 0;
+        if (indexed) {
+            index = offset;
+            for (size_t i = 0; i < blocks.size(); ++i) {
+                fixed(blocks[i]);
+            }
+        }
+        fixed(count);
+        fixed(blocks.size());
+        fixed(index);
+        put(pathlist::magic, sizeof(pathlist::magic));
+        out.flush();
+        return out.good();
+    }
+
+    inline bool PathListWriter::save(const Path& file,
+        const std::vector<Path>& paths, uint32_t block_size) {
+        std::ostringstream stream;
+        PathListWriter writer(stream, block_size);
+        for (size_t i = 0; i < paths.size(); ++i) {
+            writer.add(paths[i]);
+        }
+        return writer.finish() && Path::write_all(file, stream.str());
+    }
+
+    /**************************************************************************
+     * PathListReader
+     *************************************************************************/
+    inline PathListReader::PathListReader(const char* data, size_t size):
+        mapped(), external(data), length(size), good(false), count(0),
+        block_count(0), paths_per_block(0), index_offset(0), end(0),
+        position(0), current() {
+        open();
+    }
+
+    inline PathListReader::PathListReader(const Path& file):
+        mapped(file.map()), external(NULL), length(0), good(false),
+        count(0), block_count(0), paths_per_block(0), index_offset(0),
+        end(0), position(0), current() {
+        length = mapped.size();
+        open();
+    }
+
+    inline uint64_t PathListReader::fixed(size_t at) const {
+        uint64_t value;
+        memcpy(&value, data() + at, sizeof(value));
+        return value;
+    }
+
+    inline void PathListReader::open() {
+        using namespace pathlist;
+        if (data() == NULL || length < header_size + 1 + footer_size ||
+            memcmp(data(), magic, sizeof(magic)) != 0 ||
+            memcmp(data() + length - sizeof(magic), magic,
+                sizeof(magic)) != 0) {
+            return;
+        }
+
+        uint32_t header[2];
+        memcpy(header, data() + sizeof(magic), sizeof(header));
+        if (header[0] != version || header[1] == 0) {
+            return;
+        }
+
+        size_t footer = length - footer_size;
+        paths_per_block = header[1];
+        count = fixed(footer);
+        block_count = fixed(footer + 8);
+        index_offset = fixed(footer + 16);
+
+        /* The paths end where the index (or footer) begins */
+        end = footer;
+        if (index_offset) {
+            if (index_offset < header_size || index_offset > footer ||
+                (footer - index_offset) / 8 != block_count) {
+                return;
+            }
+            end = index_offset;
+        }
+
+        if (block_count != (count + paths_per_block - 1) / paths_per_block) {
+            return;
+        }
+        position = header_size;
+        good = true;
+    }
+
+    inline bool PathListReader::varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && position < end; shift += 7) {
+            unsigned char byte = data()[position++];
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline bool PathListReader::seek(size_t block) {
+        if (!good || !index_offset || block >= block_count) {
+            return false;
+        }
+
+        size_t at = fixed(index_offset + block * 8);
+        if (at < pathlist::header_size || at >= end) {
+            return false;
+        }
+        position = at;
+        current.clear();
+        return true;
+    }
+
+    inline bool PathListReader::next(PathView& view) {
+        uint64_t shared, suffix;
+        if (!good || !varint(shared) || shared == 0 ||
+            shared - 1 > current.size() || !varint(suffix) ||
+            suffix > end - position) {
+            return false;
+        }
+
+        current.resize(shared - 1);
+        current.append(data() + position, suffix);
+        position += suffix;
+        view = PathView(current.data(), current.size());
+        return true;
+    }
+
+    inline bool PathListReader::load(const Path& file,
+        std::vector<Path>& paths) {
+        PathListReader reader(file);
+        if (!reader.valid()) {
+            return false;
+        }
+
+        /* Rather than decode into `current` and copy that, build each path
+         * in place from the shared prefix of the one before it, and move it
+         * into the vector */
+        paths.reserve(paths.size() + reader.size());
+        size_t previous = paths.size();
+        uint64_t shared, suffix;
+        while (reader.varint(shared) && shared != 0) {
+            const std::string& before(previous < paths.size() ?
+                paths[previous].string() : reader.current);
+            if (shared - 1 > before.size() || !reader.varint(suffix) ||
+                suffix > reader.end - reader.position) {
+                break;
+            }
+
+            std::string path;
+            path.reserve(shared - 1 + suffix);
+            path.append(before, 0, shared - 1);
+            path.append(reader.data() + reader.position, suffix);
+            reader.position += suffix;
+            previous = paths.size();
+            paths.push_back(Path(std::move(path)));
+        }
+        return true;
+    }
+
+    /**************************************************************************
+     * PathListDecoder
+     *************************************************************************/
+    inline PathListDecoder::PathListDecoder(std::istream& in):
+        in(in), good(false), done(false), current() {
+        char header[pathlist::header_size];
+        if (!in.read(header, sizeof(header)) ||
+            memcmp(header, pathlist::magic, sizeof(pathlist::magic)) != 0) {
+            return;
+        }
+
+        uint32_t version;
+        memcpy(&version, header + sizeof(pathlist::magic), sizeof(version));
+        good = (version == pathlist::version);
+    }
+
+    inline bool PathListDecoder::varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = in.get();
+            if (byte == EOF) {
+                return false;
+            }
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline bool PathListDecoder::next(PathView& view) {
+        uint64_t shared, suffix;
+        if (!good || done) {
+            return false;
+        } else if (!varint(shared)) {
+            good = false;
+            return false;
+        } else if (shared == 0) {
+            done = true;
+            return false;
+        } else if (shared - 1 > current.size() || !varint(suffix)) {
+            good = false;
+            return false;
+        }
+
+        /* The length can't be checked against what's left of a stream, so
+         * read the suffix in bounded chunks and let a bogus length run out
+         * of input instead of allocating all of it up front */
+        current.resize(shared - 1);
+        while (suffix > 0) {
+            size_t chunk = std::min<uint64_t>(suffix, 65536);
+            size_t at = current.size();
+            current.resize(at + chunk);
+            if (!in.read(&current[at], chunk)) {
+                good = false;
+                return false;
+            }
+            suffix -= chunk;
+        }
+        view = PathView(current.data(), current.size());
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,552 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef APATHY__SNAPSHOT_HPP
+#define APATHY__SNAPSHOT_HPP
+
+/* C++ includes */
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+/* C includes */
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Internal libraries */
+#include "path.hpp"
+
+namespace apathy {
+    /* A record of everything in a directory tree
+     *
+     * Snapshots remember the name, type, size, modification time and inode of
+     * every entry under a root, and can be saved to and loaded from a compact
+     * file. Loading maps the file rather than parsing it.
+     *
+     * The point of a snapshot is to make rescanning cheap: `update` only
+     * lists directories whose modification time has changed, reusing the
+     * entries of the others. A directory's modification time changes when
+     * entries are added, removed or renamed, but not when a file inside is
+     * rewritten. So in directories that haven't changed, files aren't stat'd
+     * again unless asked to `verify` them */
+    class Snapshot {
+    public:
+        enum Type {
+            FILE,
+            DIRECTORY,
+            SYMLINK,
+            OTHER
+        };
+
+        /* One entry, exactly as it's stored on disk. Entry 0 is the root, and
+         * the children of each directory are contiguous and sorted by name */
+        struct Record {
+            /* Inode number */
+            uint64_t ino;
+            /* Size in bytes */
+            uint64_t size;
+            /* Modification time, in nanoseconds since the epoch */
+            int64_t mtime;
+            /* Where the name is in the name table, and how long it is */
+            uint32_t name;
+            uint32_t name_size;
+            /* For directories, the index of the first child, and how many
+             * children there are */
+            uint32_t first;
+            uint32_t children;
+            /* Index of the containing directory */
+            uint32_t parent;
+            /* One of Type */
+            uint32_t type;
+        };
+
+        /* What changed between two snapshots, as absolute paths */
+        struct Diff {
+            Diff(): added(), removed(), modified() {}
+
+            std::vector<Path> added;
+            std::vector<Path> removed;
+            std::vector<Path> modified;
+        };
+
+        Snapshot(): owned(), names(), base(), taken(0), mapped(),
+            records_offset(0), names_offset(0), count(0) {}
+
+        /* Take a snapshot of everything under a directory
+         *
+         * @param root - directory to record
+         * @param snapshot - replaced with the new snapshot
+         * @returns false if root isn't a directory */
+        static bool take(const Path& root, Snapshot& snapshot);
+
+        /* Take a new snapshot of the same tree, listing only the directories
+         * that have changed since this one was taken
+         *
+         * @param next - replaced with the new snapshot
+         * @param diff - filled with what changed
+         * @param verify - stat files in unchanged directories, to find files
+         *     that were modified in place */
+        bool update(Snapshot& next, Diff& diff, bool verify=false) const;
+
+        /* Save this snapshot to a file, atomically replacing it */
+        bool save(const Path& file) const;
+
+        /* Map a snapshot saved with `save`
+         *
+         * @returns false if the file is missing or isn't a valid snapshot */
+        bool load(const Path& file);
+
+        /* The directory this is a snapshot of */
+        Path root() const { return Path(base); }
+
+        /* The number of entries, including the root */
+        size_t size() const { return count; }
+
+        /* Access an entry */
+        const Record& operator[](size_t i) const { return records()[i]; }
+
+        /* The name of an entry */
+        std::string name(size_t i) const;
+
+        /* The absolute path of an entry */
+        Path path(size_t i) const;
+
+        /* Directories modified this close to when the snapshot was taken
+         * (in nanoseconds) may have been modified again without their
+         * modification time changing, and are always listed again */
+        static const int64_t racy = 1000000000LL;
+
+    private:
+        /* The start of the file */
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t record_size;
+            uint64_t count;
+            uint64_t names;
+            int64_t taken;
+            uint64_t root;
+        };
+
+        /* State while scanning a tree */
+        struct Scan {
+            Scan(): records(), names(), old(NULL), diff(NULL),
+                verify(false) {}
+            Scan(const Scan& other) = delete;
+            Scan& operator=(const Scan& other) = delete;
+
+            std::vector<Record> records;
+            std::string names;
+            /* The snapshot being updated and the differences from it, if
+             * any */
+            const Snapshot* old;
+            Diff* diff;
+            bool verify;
+        };
+
+        /* A directory entry seen while scanning */
+        struct Child {
+            bool operator<(const Child& other) const {
+                return name < other.name;
+            }
+
+            std::string name;
+            Record record;
+            /* The matching entry in the old snapshot, if any */
+            int64_t old;
+        };
+
+        static const char* magic() { return "APSNAP1"; }
+
+        /* Where the records and names are, whether owned or mapped */
+        const Record* records() const;
+        const char* name_table() const;
+
+        /* Whether a stored name could have come from a directory listing:
+         * not empty, '.' or '..', and without separators or NULs */
+        static bool valid_name(const char* name, size_t size);
+
+        /* Fill a record from lstat, returning false if it doesn't exist */
+        static bool stat_record(const std::string& path, Record& record);
+
+        /* Record the children of the directory at index, recursively.
+         * `old` is the index of the same directory in the old snapshot, or
+         * -1 if there isn't one */
+        static void scan(Scan& state, uint32_t index, const Path& dir,
+            int64_t old);
+
+        /* Report everything under an entry of this snapshot as removed */
+        void removed(size_t index, const Path& path, Diff& diff) const;
+
+        /* Take ownership of a finished scan */
+        void adopt(const Path& root, int64_t taken, Scan& state);
+
+        /* Entries, when built in memory */
+        std::vector<Record> owned;
+        std::string names;
+        /* The root directory */
+        std::string base;
+        /* When the scan began, in nanoseconds since the epoch */
+        int64_t taken;
+        /* The file, when loaded */
+        MappedFile mapped;
+        size_t records_offset;
+        size_t names_offset;
+        /* How many entries there are */
+        size_t count;
+    };
+
+    inline const Snapshot::Record* Snapshot::records() const {
+        if (mapped.valid()) {
+            return reinterpret_cast<const Record*>(
+                mapped.data() + records_offset);
+        }
+        return owned.empty() ? NULL : &owned[0];
+    }
+
+    inline const char* Snapshot::name_table() const {
+        if (mapped.valid()) {
+            return mapped.data() + names_offset;
+        }
+        return names.data();
+    }
+
+    inline std::string Snapshot::name(size_t i) const {
+        const Record& record(records()[i]);
+        return std::string(name_table() + record.name, record.name_size);
+    }
+
+    inline Path Snapshot::path(size_t i) const {
+        /* Walk up to the root, collecting names */
+        std::vector<size_t> chain;
+        for (; i != 0; i = records()[i].parent) {
+            chain.push_back(i);
+        }
+
+        Path result(base);
+        std::vector<size_t>::reverse_iterator it(chain.rbegin());
+        for (; it != chain.rend(); ++it) {
+            result.append(name(*it));
+        }
+        return result;
+    }
+
+    inline bool Snapshot::valid_name(const char* name, size_t size) {
+        if (size == 0 || memchr(name, Path::separator, size) != NULL ||
+            memchr(name, '\0', size) != NULL) {
+            return false;
+        }
+        return !(name[0] == '.' && (size == 1 ||
+            (size == 2 && name[1] == '.')));
+    }
+
+    inline bool Snapshot::stat_record(const std::string& path,
+        Record& record) {
+        struct stat buf;
+        if (lstat(path.c_str(), &buf) != 0) {
+            return false;
+        }
+
+        record.ino = buf.st_ino;
+        record.size = buf.st_size;
+        record.mtime = buf.st_mtim.tv_sec * 1000000000LL +
+            buf.st_mtim.tv_nsec;
+        if (S_ISREG(buf.st_mode)) {
+            record.type = FILE;
+        } else if (S_ISDIR(buf.st_mode)) {
+            record.type = DIRECTORY;
+        } else if (S_ISLNK(buf.st_mode)) {
+            record.type = SYMLINK;
+        } else {
+            record.type = OTHER;
+        }
+        return true;
+    }
+
+    inline void Snapshot::scan(Scan& state, uint32_t index, const Path& dir,
+        int64_t old) {
+        const Snapshot* previous(state.old);
+        const Record* before(NULL);
+        if (previous && old >= 0 &&
+            previous->records()[old].type == DIRECTORY) {
+            before = &previous->records()[old];
+        }
+
+        /* If the directory hasn't been touched since it was last listed, then
+         * its entries are the same as last time */
+        const Record current(state.records[index]);
+        bool unchanged = before &&
+            before->ino == current.ino && before->mtime == current.mtime &&
+            current.mtime < previous->taken - racy;
+
+        std::vector<Child> children;
+        if (unchanged) {
+            children.reserve(before->children);
+            for (uint32_t i = 0; i < before->children; ++i) {
+                Child child = { previous->name(before->first + i),
+                    previous->records()[before->first + i],
+                    before->first + i };
+                /* Directories need to be checked for changes of their own */
+                if (child.record.type == DIRECTORY || state.verify) {
+                    Path path(dir);
+                    path.append(child.name);
+                    if (!stat_record(path.string(), child.record)) {
+                        if (state.diff) {
+                            previous->removed(child.old, path, *state.diff);
+                        }
+                        continue;
+                    }
+                }
+                children.push_back(child);
+            }
+        } else {
+            std::vector<Path> listed(Path::listdir(dir));
+            children.reserve(listed.size());
+            for (size_t i = 0; i < listed.size(); ++i) {
+                Child child = { listed[i].filename(), Record(), -1 };
+                if (stat_record(listed[i].string(), child.record)) {
+                    children.push_back(child);
+                }
+            }
+            std::sort(children.begin(), children.end());
+
+            /* Match them up with what was there before, which is also
+             * sorted by name */
+            if (before) {
+                uint32_t i = 0;
+                std::vector<Child>::iterator it(children.begin());
+                while (i < before->children || it != children.end()) {
+                    uint32_t o = before->first + i;
+                    int order = (i == before->children) ? 1 :
+                        (it == children.end()) ? -1 :
+                        previous->name(o).compare(it->name);
+                    if (order < 0) {
+                        if (state.diff) {
+                            Path path(dir);
+                            previous->removed(o, path.append(
+                                previous->name(o)), *state.diff);
+                        }
+                        ++i;
+                    } else if (order > 0) {
+                        ++it;
+                    } else {
+                        it->old = o;
+                        ++i;
+                        ++it;
+                    }
+                }
+            }
+        }
+
+        /* Report the differences for this directory */
+        if (state.diff) {
+            std::vector<Child>::iterator it(children.begin());
+            for (; it != children.end(); ++it) {
+                Path path(dir);
+                path.append(it->name);
+                if (it->old < 0) {
+                    state.diff->added.push_back(path);
+                    continue;
+                }
+
+                const Record& was(previous->records()[it->old]);
+                if (was.type != it->record.type) {
+                    /* Something else entirely now has this name */
+                    previous->removed(it->old, path, *state.diff);
+                    state.diff->added.push_back(path);
+                    it->old = -1;
+                } else if (was.type != DIRECTORY && (was.ino !=
+                    it->record.ino || was.size != it->record.size ||
+                    was.mtime != it->record.mtime)) {
+                    state.diff->modified.push_back(path);
+                }
+            }
+        }
+
+        /* The children all go in one block */
+        uint32_t first = state.records.size();
+        state.records[index].first = first;
+        state.records[index].children = children.size();
+        for (size_t i = 0; i < children.size(); ++i) {
+            Record record(children[i].record);
+            record.name = state.names.size();
+            record.name_size = children[i].name.size();
+            record.first = 0;
+            record.children = 0;
+            record.parent = index;
+            state.names.append(children[i].name);
+            state.records.push_back(record);
+        }
+
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (children[i].record.type == DIRECTORY) {
+                Path path(dir);
+                scan(state, first + i, path.append(children[i].name),
+                    children[i].old);
+            }
+        }
+    }
+
+    inline void Snapshot::removed(size_t index, const Path& path,
+        Diff& diff) const {
+        diff.removed.push_back(path);
+        const Record& record(records()[index]);
+        if (record.type == DIRECTORY) {
+            for (uint32_t i = 0; i < record.children; ++i) {
+                Path child(path);
+                removed(record.first + i, child.append(
+                    name(record.first + i)), diff);
+            }
+        }
+    }
+
+    inline void Snapshot::adopt(const Path& root, int64_t start,
+        Scan& state) {
+        mapped = MappedFile();
+        owned.swap(state.records);
+        names.swap(state.names);
+        base = root.string();
+        taken = start;
+        count = owned.size();
+    }
+
+    inline bool Snapshot::take(const Path& root, Snapshot& snapshot) {
+        Diff diff;
+        Snapshot empty;
+        empty.base = Path(root).absolute().trim().string();
+        return empty.update(snapshot, diff);
+    }
+
+    inline bool Snapshot::update(Snapshot& next, Diff& diff,
+        bool verify) const {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t start = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+        Scan state;
+        state.old = count ? this : NULL;
+        state.diff = count ? &diff : NULL;
+        state.verify = verify;
+
+        Record root = Record();
+        if (!stat_record(base, root) || root.type != DIRECTORY) {
+            return false;
+        }
+        state.records.push_back(root);
+        scan(state, 0, base, count ? 0 : -1);
+
+        next.adopt(base, start, state);
+        return true;
+    }
+
+    inline bool Snapshot::save(const Path& file) const {
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic(), sizeof(header.magic));
+        header.version = 1;
+        header.record_size = sizeof(Record);
+        header.count = count;
+        header.names = mapped.valid() ?
+            mapped.size() - names_offset : names.size();
+        header.taken = taken;
+        header.root = base.size();
+
+        /* Keep the records aligned after the root path */
+        std::string contents(reinterpret_cast<const char*>(&header),
+            sizeof(header));
+        contents.append(base);
+        contents.resize((contents.size() + 7) & ~size_t(7), '\0');
+        contents.append(reinterpret_cast<const char*>(records()),
+            count * sizeof(Record));
+        contents.append(name_table(), header.names);
+        return Path::atomic_write(file, contents);
+    }
+
+    inline bool Snapshot::load(const Path& file) {
+        MappedFile contents(file.map(MADV_RANDOM));
+        Header header;
+        if (!contents.valid() || contents.size() < sizeof(header)) {
+            return false;
+        }
+
+        memcpy(&header, contents.data(), sizeof(header));
+        if (memcmp(header.magic, magic(), sizeof(header.magic)) != 0 ||
+            header.version != 1 || header.record_size != sizeof(Record) ||
+            header.count == 0) {
+            return false;
+        }
+
+        /* The root is scanned again on update, so it has to be an absolute
+         * path that means the same thing as a C string */
+        const char* root = contents.data() + sizeof(header);
+        if (header.root == 0 || header.root > contents.size() - sizeof(header)
+            || root[0] != Path::separator ||
+            memchr(root, '\0', header.root) != NULL) {
+            return false;
+        }
+        size_t records_at = (sizeof(header) + header.root + 7) & ~size_t(7);
+        if (records_at > contents.size() ||
+            header.count > (contents.size() - records_at) / sizeof(Record)) {
+            return false;
+        }
+        size_t names_at = records_at + header.count * sizeof(Record);
+        if (contents.size() - names_at != header.names) {
+            return false;
+        }
+
+        /* Make sure nothing points outside of the file, that parents come
+         * before their children, so that walking up to the root or down
+         * through children always ends, and that every name is a single
+         * path segment */
+        const Record* loaded = reinterpret_cast<const Record*>(
+            contents.data() + records_at);
+        const char* table = contents.data() + names_at;
+        for (size_t i = 0; i < header.count; ++i) {
+            const Record& record(loaded[i]);
+            if (record.name > header.names ||
+                record.name_size > header.names - record.name ||
+                record.first > header.count ||
+                record.children > header.count - record.first ||
+                (record.children && record.first <= i) ||
+                (i > 0 && record.parent >= i) || record.type > OTHER ||
+                (i > 0 && !valid_name(table + record.name,
+                    record.name_size))) {
+                return false;
+            }
+        }
+
+        owned.clear();
+        names.clear();
+        base.assign(contents.data() + sizeof(header), header.root);
+        taken = header.taken;
+        count = header.count;
+        records_offset = records_at;
+        names_offset = names_at;
+        mapped = std::move(contents);
+        return true;
+    }
+}
+
+#endif
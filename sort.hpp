@@ -0,0 +1,364 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef APATHY__SORT_HPP
+#define APATHY__SORT_HPP
+
+/* C++ includes */
+#include <string>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <utility>
+#include <algorithm>
+
+/* C includes */
+#include <stdint.h>
+
+/* Internal libraries */
+#include "path.hpp"
+
+namespace apathy {
+    /* Orders paths segment by segment, so that a directory is followed by
+     * everything under it before any of its siblings:
+     *
+     *   /a
+     *   /a/b
+     *   /a/b/c
+     *   /a-b
+     *
+     * This is the same as comparing bytes, except that the separator sorts
+     * before every other byte */
+    struct PathLess {
+        bool operator()(const Path& a, const Path& b) const {
+            return compare(a.string(), b.string()) < 0;
+        }
+
+        /* Less than, equal to or greater than zero, like strcmp
+         *
+         * @param depth - how many leading bytes are known to be equal */
+        static int compare(const std::string& a, const std::string& b,
+            size_t depth=0) {
+            return compare(a.data(), a.size(), b.data(), b.size(), depth);
+        }
+        static int compare(const char* a, size_t a_size, const char* b,
+            size_t b_size, size_t depth=0);
+
+        /* The rank of a byte: the separator sorts first, and everything else
+         * keeps its order. Paths can't contain NUL, so it shares a rank with
+         * the separator, leaving 0 to mean "past the end" */
+        static unsigned char rank(unsigned char c) {
+            const unsigned char separator = Path::separator;
+            return c == separator ? 1 : (c < separator ? c + 1 : c);
+        }
+
+        /* The ranks of the eight bytes at depth, packed so that comparing
+         * keys compares those bytes in order. Past the end is zero */
+        static uint64_t key(const char* data, size_t size, size_t depth);
+    };
+
+    /* Sorting, merging and deduplicating large collections of paths, in the
+     * order of PathLess.
+     *
+     * Sorting is a most-significant-digit radix sort whose digits are eight
+     * bytes wide: paths are ordered by their first eight bytes, then each
+     * group that's equal in those by the next eight, and so on. The prefix a
+     * group shares is never looked at again, and the digits are cached
+     * alongside each path so that ordering them doesn't chase pointers.
+     * Paths are moved, never copied. */
+    class PathSort {
+    public:
+        /* Collections smaller than this are always sorted on one thread */
+        static const size_t parallel_threshold = 1 << 15;
+
+        /* Sort paths in place
+         *
+         * @param paths - paths to sort
+         * @param threads - how many threads to use, or 0 for one per core */
+        static void sort(std::vector<Path>& paths, size_t threads=0);
+
+        /* Merge sorted runs into one sorted list
+         *
+         * @param runs - sorted runs, whose paths are moved out
+         * @param out - the merged paths are appended to this */
+        static void merge(std::vector<std::vector<Path> >& runs,
+            std::vector<Path>& out);
+
+        /* Remove duplicates from sorted paths, in place
+         *
+         * @param paths - sorted paths
+         * @param normalize - sanitize and trim paths first so that spellings
+         *     of the same path (`a//b/` and `a/b`) are duplicates. The paths
+         *     are sorted again afterwards, since sanitizing changes order
+         * @returns the number of paths removed */
+        static size_t unique(std::vector<Path>& paths, bool normalize=false);
+
+    private:
+        /* Below this many paths, insertion sort is faster */
+        static const size_t insertion_threshold = 16;
+
+        /* A path to sort, with its digit at the current depth */
+        struct Entry {
+            uint64_t key;
+            const char* data;
+            size_t size;
+            /* Where the path was */
+            size_t index;
+        };
+
+        /* Sort the paths in [begin, end) */
+        static void sort(Path* begin, Path* end);
+
+        /* Sort n entries, all equal in their first depth bytes, with keys
+         * for that depth */
+        static void sort(Entry* entries, size_t n, size_t depth);
+
+        /* Insertion sort of n entries, all equal in their first depth
+         * bytes */
+        static void insertion(Entry* entries, size_t n, size_t depth);
+    };
+
+    /**************************************************************************
+     * Implementations
+     *************************************************************************/
+    inline int PathLess::compare(const char* a, size_t a_size, const char* b,
+        size_t b_size, size_t depth) {
+        /* Skip the common prefix a word at a time */
+        size_t limit = std::min(a_size, b_size);
+        while (depth + 8 <= limit && memcmp(a + depth, b + depth, 8) == 0) {
+            depth += 8;
+        }
+        while (depth < limit && a[depth] == b[depth]) {
+            ++depth;
+        }
+
+        if (depth == limit) {
+            return (a_size > limit) - (b_size > limit);
+        }
+        return rank(a[depth]) - rank(b[depth]);
+    }
+
+    inline uint64_t PathLess::key(const char* data, size_t size,
+        size_t depth) {
+        uint64_t result = 0;
+        size_t end = std::min(size, depth + 8);
+        size_t i = depth;
+        for (; i < end; ++i) {
+            result = (result << 8) | rank(data[i]);
+        }
+        for (; i < depth + 8; ++i) {
+            result <<= 8;
+        }
+        return result;
+    }
+
+    inline void PathSort::insertion(Entry* entries, size_t n, size_t depth) {
+        for (size_t i = 1; i < n; ++i) {
+            Entry current(entries[i]);
+            size_t j = i;
+            for (; j > 0 && PathLess::compare(entries[j - 1].data,
+                entries[j - 1].size, current.data, current.size, depth) > 0;
+                --j) {
+                entries[j] = entries[j - 1];
+            }
+            entries[j] = current;
+        }
+    }
+
+    inline void PathSort::sort(Entry* entries, size_t n, size_t depth) {
+        if (n <= insertion_threshold) {
+            insertion(entries, n, depth);
+            return;
+        }
+
+        /* Order by the digit at this depth */
+        std::sort(entries, entries + n, [](const Entry& a, const Entry& b) {
+            return a.key < b.key;
+        });
+
+        /* Then each group that's equal in that digit by the next one, unless
+         * they ended within it and so are identical */
+        for (size_t i = 0, j; i < n; i = j) {
+            for (j = i + 1; j < n && entries[j].key == entries[i].key; ++j);
+            if (j - i > 1 && (entries[i].key & 0xFF)) {
+                for (size_t k = i; k < j; ++k) {
+                    entries[k].key = PathLess::key(
+                        entries[k].data, entries[k].size, depth + 8);
+                }
+                sort(entries + i, j - i, depth + 8);
+            }
+        }
+    }
+
+    inline void PathSort::sort(Path* begin, Path* end) {
+        size_t n = end - begin;
+        if (n < 2) {
+            return;
+        }
+
+        /* Start after whatever prefix all the paths share */
+        const std::string& first = begin->string();
+        size_t depth = first.size();
+        for (size_t i = 1; i < n && depth; ++i) {
+            const std::string& path = begin[i].string();
+            depth = std::min(depth, path.size());
+            depth = std::mismatch(first.data(), first.data() + depth,
+                path.data()).first - first.data();
+        }
+
+        std::vector<Entry> entries(n);
+        for (size_t i = 0; i < n; ++i) {
+            const std::string& path = begin[i].string();
+            entries[i].data = path.data();
+            entries[i].size = path.size();
+            entries[i].key = PathLess::key(path.data(), path.size(), depth);
+            entries[i].index = i;
+        }
+        sort(&entries[0], n, depth);
+
+        /* Then move each path into place once */
+        std::vector<Path> sorted;
+        sorted.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            sorted.push_back(std::move(begin[entries[i].index]));
+        }
+        std::move(sorted.begin(), sorted.end(), begin);
+    }
+
+    inline void PathSort::sort(std::vector<Path>& paths, size_t threads) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (paths.size() < parallel_threshold) {
+            threads = 1;
+        }
+
+        /* Each thread sorts a contiguous chunk */
+        std::vector<size_t> bounds;
+        for (size_t i = 0; i <= threads; ++i) {
+            bounds.push_back(paths.size() * i / threads);
+        }
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.push_back(std::thread([&paths, &bounds, i]() {
+                sort(paths.data() + bounds[i], paths.data() + bounds[i + 1]);
+            }));
+        }
+        sort(paths.data(), paths.data() + bounds[1]);
+        for (size_t i = 0; i < pool.size(); ++i) {
+            pool[i].join();
+        }
+        pool.clear();
+
+        /* And then neighboring chunks are merged pairwise, in parallel,
+         * until there's only one */
+        for (size_t width = 1; width < threads; width *= 2) {
+            for (size_t i = 0; i + width < threads; i += 2 * width) {
+                size_t lo = bounds[i], mid = bounds[i + width];
+                size_t hi = bounds[std::min(i + 2 * width, threads)];
+                pool.push_back(std::thread([&paths, lo, mid, hi]() {
+                    std::inplace_merge(paths.begin() + lo,
+                        paths.begin() + mid, paths.begin() + hi, PathLess());
+                }));
+            }
+            for (size_t i = 0; i < pool.size(); ++i) {
+                pool[i].join();
+            }
+            pool.clear();
+        }
+    }
+
+    inline void PathSort::merge(std::vector<std::vector<Path> >& runs,
+        std::vector<Path>& out) {
+        size_t total = 0;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            total += runs[i].size();
+        }
+        out.reserve(out.size() + total);
+
+        /* A heap of the next unmerged path in each run, as (run, position),
+         * smallest on top. Ties go to the earlier run, so merging is stable */
+        typedef std::pair<size_t, size_t> Head;
+        auto greater = [&runs](const Head& a, const Head& b) {
+            int c = PathLess::compare(runs[a.first][a.second].string(),
+                runs[b.first][b.second].string());
+            return c > 0 || (c == 0 && a.first > b.first);
+        };
+
+        std::vector<Head> heap;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            if (!runs[i].empty()) {
+                heap.push_back(Head(i, 0));
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), greater);
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            Head& head = heap.back();
+            out.push_back(std::move(runs[head.first][head.second]));
+            if (++head.second < runs[head.first].size()) {
+                std::push_heap(heap.begin(), heap.end(), greater);
+            } else {
+                heap.pop_back();
+            }
+        }
+
+        for (size_t i = 0; i < runs.size(); ++i) {
+            runs[i].clear();
+        }
+    }
+
+    inline size_t PathSort::unique(std::vector<Path>& paths, bool normalize) {
+        if (normalize) {
+            for (size_t i = 0; i < paths.size(); ++i) {
+                /* Trimming would turn the root into an empty path */
+                if (paths[i].sanitize().string().size() > 1) {
+                    paths[i].trim();
+                }
+            }
+            sort(paths);
+        }
+
+        if (paths.empty()) {
+            return 0;
+        }
+
+        size_t kept = 1;
+        for (size_t i = 1; i < paths.size(); ++i) {
+            if (paths[i].string() != paths[kept - 1].string()) {
+                if (i != kept) {
+                    paths[kept] = std::move(paths[i]);
+                }
+                ++kept;
+            }
+        }
+
+        size_t removed = paths.size() - kept;
+        paths.erase(paths.begin() + kept, paths.end());
+        return removed;
+    }
+}
+
+#endif
@@ -26,12 +26,55 @@
 
 #include <catch.hpp>
 #include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <type_traits>
 
 /* Internal libraries */
 #include "path.hpp"
+#include "watcher.hpp"
+#include "snapshot.hpp"
+#include "trie.hpp"
+#include "pathlist.hpp"
+#include "sort.hpp"
 
 using namespace apathy;
 
+/* Read the whole contents of a file through a stream */
+std::string slurp(const Path& path) {
+    std::ifstream stream(path.string().c_str(), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(stream),
+        std::istreambuf_iterator<char>());
+}
+
+/* Does the list of events contain this one? */
+bool has_event(const std::vector<PathWatcher::Event>& events,
+    PathWatcher::Event::Type type, const Path& path) {
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (events[i].type == type &&
+            events[i].path.string() == Path(path).absolute().string()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Does the list of paths contain this one? */
+bool has_path(const std::vector<Path>& paths, const Path& path) {
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (paths[i].string() == Path(path).absolute().string()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Replace the contents of a file through a stream */
+void spit(const Path& path, const std::string& contents) {
+    std::ofstream stream(path.string().c_str(), std::ios::binary);
+    stream << contents;
+}
+
 TEST_CASE("path", "Path functionality works as advertised") {
     SECTION("cwd", "And equivalent vs ==") {
         Path cwd(Path::cwd());
@@ -69,6 +112,54 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE((root + "baz").string() == "foo/bar/baz");
     }
 
+    SECTION("join", "Make sure we can join any number of paths") {
+        REQUIRE(Path::join("foo", "bar").string() == "foo/bar");
+        REQUIRE(Path::join("foo/", "bar").string() == "foo/bar");
+        REQUIRE(Path::join("/foo", "bar", "baz").string() == "/foo/bar/baz");
+        REQUIRE(Path::join("", "foo", 5, Path("bar/"), 3.5).string() ==
+            "/foo/5/bar/3.5");
+        REQUIRE(Path::join("a", "b", "c").string().capacity() >= 5);
+    }
+
+    SECTION("temporaries", "Make sure manipulating temporaries moves them") {
+        /* Manipulating a temporary yields a value, not a reference */
+        static_assert(std::is_same<decltype(Path("a").append("b")),
+            Path>::value, "append on a temporary returns a value");
+        static_assert(std::is_same<decltype(std::declval<Path&>().append(
+            "b")), Path&>::value, "append on a path returns a reference");
+
+        REQUIRE(Path("foo").append("bar").append("baz").string() ==
+            "foo/bar/baz");
+        REQUIRE((Path("foo") + "bar" + "baz").string() == "foo/bar/baz");
+        REQUIRE((Path("foo") << "bar" << 5).string() == "foo/bar/5");
+        REQUIRE(Path("foo//bar/../baz/").sanitize().trim().string() ==
+            "foo/baz");
+        REQUIRE(Path("foo").directory().string() == "foo/");
+        REQUIRE(Path("foo/bar").up().string() == "foo/");
+        REQUIRE(Path("/foo").relative("bar").string() == "/foo/bar");
+        REQUIRE(Path("foo").absolute().string() ==
+            Path::cwd().append("foo").string());
+
+        /* Storage is handed along by each overload that works in place,
+         * rather than copied (sanitize and up build a new string anyway) */
+        Path long_path(std::string(100, 'a'));
+        long_path.reserve(256);
+        const char* storage = long_path.string().data();
+        Path appended(std::move(long_path).append("b"));
+        REQUIRE(appended.string().data() == storage);
+        Path added(std::move(appended) + "c");
+        REQUIRE(added.string().data() == storage);
+        Path shifted(std::move(added) << "d" << 5);
+        REQUIRE(shifted.string().data() == storage);
+        Path related(std::move(shifted).relative("e"));
+        REQUIRE(related.string().data() == storage);
+        Path directory(std::move(related).directory());
+        REQUIRE(directory.string().data() == storage);
+        Path trimmed(std::move(directory).trim());
+        REQUIRE(trimmed.string().data() == storage);
+        REQUIRE(trimmed.string() == std::string(100, 'a') + "/b/c/d/5/e");
+    }
+
     SECTION("trim", "Make sure trim actually strips off separators") {
         Path root("/hello/how/are/you////");
         REQUIRE(root.trim().string() == "/hello/how/are/you");
@@ -120,6 +211,130 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(a.parent() == "bar/");
     }
 
+    SECTION("segments", "Make sure we can get at individual segments") {
+        Path a("/foo//bar/baz/");
+        REQUIRE(a.segment_count() == 3);
+        REQUIRE(a.segment(0) == "foo");
+        REQUIRE(a.segment(1) == "bar");
+        REQUIRE(a.segment(2) == "baz");
+        REQUIRE(a.segment(3) == "");
+        REQUIRE(Path("").segment_count() == 0);
+        REQUIRE(Path("/").segment_count() == 0);
+        REQUIRE(Path("foo").segment(0) == "foo");
+
+        /* The index follows the path as it changes */
+        a.append("whiz");
+        REQUIRE(a.segment_count() == 4);
+        REQUIRE(a.segment(3) == "whiz");
+        a.sanitize();
+        REQUIRE(a.parent().string() == "/foo/bar/baz/");
+        a.up();
+        REQUIRE(a.segment_count() == 3);
+        a.trim().directory();
+        REQUIRE(a.segment(2) == "baz");
+        a = Path("x/y");
+        REQUIRE(a.segment_count() == 2);
+        Path b(a);
+        b << "z";
+        REQUIRE(a.segment_count() == 2);
+        REQUIRE(b.segment_count() == 3);
+
+        /* Parents of clean paths are truncations, and match `up` */
+        const char* paths[] = { "/a/b/c", "a/b/c/", "a", "/a", "/", "",
+            "a/./b", "a/../b/c", "a//b", "../a", ".." };
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+            REQUIRE(Path(paths[i]).parent().string() ==
+                Path(paths[i]).up().string());
+        }
+
+        /* Const accessors may build the index from several threads */
+        for (size_t round = 0; round < 100; ++round) {
+            const Path shared("/a/b/c/d");
+            std::atomic<size_t> agreed(0);
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < 4; ++i) {
+                threads.push_back(std::thread([&shared, &agreed]() {
+                    if (shared.segment_count() == 4 &&
+                        shared.segment(3) == "d" &&
+                        shared.parent().string() == "/a/b/c/") {
+                        ++agreed;
+                    }
+                }));
+            }
+            for (size_t i = 0; i < threads.size(); ++i) {
+                threads[i].join();
+            }
+            REQUIRE(agreed == 4);
+        }
+
+        /* Moving takes the index along */
+        Path indexed("/x/y/z");
+        REQUIRE(indexed.segment_count() == 3);
+        Path taken(std::move(indexed));
+        REQUIRE(taken.segment(2) == "z");
+        indexed = Path("p/q");
+        REQUIRE(indexed.segment_count() == 2);
+        indexed = std::move(taken);
+        REQUIRE(indexed.segment_count() == 3);
+    }
+
+    SECTION("relative_to", "Make sure we can make paths relative") {
+        REQUIRE(Path("/a/b/c").relative_to("/a/d").string() == "../b/c");
+        REQUIRE(Path("/a/b/c").relative_to("/a").string() == "b/c");
+        REQUIRE(Path("/a/b/c/").relative_to("/a/b").string() == "c/");
+        REQUIRE(Path("/a").relative_to("/a/b/c").string() == "../../");
+        REQUIRE(Path("/a/b").relative_to("/a/b/").string() == "");
+        REQUIRE(Path("/a/b").relative_to("/").string() == "a/b");
+        REQUIRE(Path("/a/bc").relative_to("/a/b").string() == "../bc");
+        REQUIRE(Path("a/b").relative_to("a/c/d").string() == "../../b");
+        REQUIRE(Path("a/b").relative_to("").string() == "a/b");
+
+        /* Unclean paths are compared as if sanitized */
+        REQUIRE(Path("/a//b/./c").relative_to("/a/x/../b").string() == "c");
+        REQUIRE(Path("a/../../b").relative_to("../c").string() == "../b");
+
+        /* And mixing absolute and relative paths uses the cwd */
+        Path cwd(Path::cwd());
+        REQUIRE(Path(cwd).append("a/b").relative_to("a").string() == "b");
+        REQUIRE(Path("a/b").relative_to(Path(cwd).append("a")).string() ==
+            "b");
+    }
+
+    SECTION("common_prefix", "Make sure we can find common prefixes") {
+        REQUIRE(Path::common_prefix("/a/b/c", "/a/bd").string() == "/a");
+        REQUIRE(Path::common_prefix("/a/b/c", "/a/b/d").string() == "/a/b");
+        REQUIRE(Path::common_prefix("/a/b/", "/a/b/c").string() == "/a/b");
+        REQUIRE(Path::common_prefix("/a/b", "/a/b").string() == "/a/b");
+        REQUIRE(Path::common_prefix("/a", "/b").string() == "/");
+        REQUIRE(Path::common_prefix("a/b", "a/c").string() == "a");
+        REQUIRE(Path::common_prefix("ab", "ac").string() == "");
+        REQUIRE(Path::common_prefix("", "a").string() == "");
+
+        /* Unclean paths are compared as if sanitized, and mixed ones as if
+         * absolute */
+        REQUIRE(Path::common_prefix("/a//b/./c", "/a/x/../b/d").string() ==
+            "/a/b");
+        Path cwd(Path(Path::cwd()).trim());
+        REQUIRE(Path::common_prefix("a/b", Path(cwd).append("a/c")) ==
+            Path(cwd).append("a"));
+        REQUIRE(Path::common_prefix("../a", "b") == cwd.parent().trim());
+
+        std::vector<Path> paths;
+        REQUIRE(Path::common_prefix(paths).string() == "");
+        for (size_t i = 0; i < 70000; ++i) {
+            paths.push_back(Path("/srv/data").append(i % 7).append(i));
+        }
+        for (size_t threads = 1; threads <= 3; ++threads) {
+            REQUIRE(Path::common_prefix(paths, threads).string() ==
+                "/srv/data");
+        }
+        paths[69999] = Path("/srv/database");
+        REQUIRE(Path::common_prefix(paths, 3).string() == "/srv");
+        paths[0] = Path("relative");
+        REQUIRE(Path::common_prefix(paths, 3) ==
+            Path::common_prefix(cwd, "/srv"));
+    }
+
     SECTION("makedirs", "Make sure we recursively make directories") {
         Path path("foo");
         REQUIRE(!path.exists());
@@ -286,4 +501,902 @@ TEST_CASE("path", "Path functionality works as advertised") {
         REQUIRE(Path::rmdirs("foo"));
         REQUIRE(!Path("foo").exists());
     }
+
+    SECTION("copy", "Make sure we can copy files") {
+        std::string contents(3 << 20, 'a');
+        for (size_t i = 0; i < contents.size(); i += 7) {
+            contents[i] = 'a' + (i % 26);
+        }
+
+        Path::makedirs("foo");
+        spit("foo/bar", contents);
+        chmod("foo/bar", 0640);
+        struct timespec times[2] = { {1000, 0}, {2000, 0} };
+        utimensat(AT_FDCWD, "foo/bar", times, 0);
+
+        REQUIRE(Path::copy("foo/bar", "foo/baz"));
+        REQUIRE(slurp("foo/baz") == contents);
+
+        /* Won't clobber an existing file unless asked to */
+        spit("foo/baz", "hello");
+        REQUIRE(!Path::copy("foo/bar", "foo/baz"));
+        REQUIRE(slurp("foo/baz") == "hello");
+        REQUIRE(Path::copy("foo/bar", "foo/baz", Path::COPY_OVERWRITE |
+            Path::COPY_MODE | Path::COPY_TIMES));
+        REQUIRE(slurp("foo/baz") == contents);
+
+        struct stat st;
+        REQUIRE(stat("foo/baz", &st) == 0);
+        REQUIRE((st.st_mode & 07777) == 0640);
+        REQUIRE(st.st_mtime == 2000);
+
+        /* Copying a file onto itself must not truncate it */
+        REQUIRE(!Path::copy("foo/bar", "foo/bar", Path::COPY_OVERWRITE));
+        REQUIRE(slurp("foo/bar") == contents);
+
+        /* Can't copy things that don't exist, or directories */
+        REQUIRE(!Path::copy("foo/whiz", "foo/bang"));
+        REQUIRE(!Path::copy("foo", "bar"));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("copytree", "Make sure we can recursively copy directories") {
+        Path::makedirs("foo/a/b");
+        Path::makedirs("foo/c");
+        for (int i = 0; i < 20; ++i) {
+            spit(Path("foo/a/b") << i, "contents" + std::to_string(i));
+            spit(Path("foo/c") << i, "other" + std::to_string(i));
+        }
+        spit("foo/d", "top");
+        REQUIRE(symlink("d", "foo/e") == 0);
+
+        REQUIRE(Path::copytree("foo", "bar", 0, 4));
+        for (int i = 0; i < 20; ++i) {
+            REQUIRE(slurp(Path("bar/a/b") << i) ==
+                "contents" + std::to_string(i));
+            REQUIRE(slurp(Path("bar/c") << i) ==
+                "other" + std::to_string(i));
+        }
+        REQUIRE(slurp("bar/d") == "top");
+        REQUIRE(slurp("bar/e") == "top");
+
+        char link[16] = { 0 };
+        REQUIRE(readlink("bar/e", link, sizeof(link)) == 1);
+        REQUIRE(std::string(link) == "d");
+
+        /* Copying onto an existing tree requires permission */
+        REQUIRE(!Path::copytree("foo", "bar"));
+        REQUIRE( Path::copytree("foo", "bar", Path::COPY_OVERWRITE));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(Path::rmdirs("bar"));
+        REQUIRE(!Path("foo").exists());
+        REQUIRE(!Path("bar").exists());
+    }
+
+    SECTION("map", "Make sure we can map files into memory") {
+        Path::makedirs("foo");
+        spit("foo/bar", "hello world");
+        MappedFile mapped(Path("foo/bar").map());
+        REQUIRE(mapped.valid());
+        REQUIRE(std::string(mapped.begin(), mapped.end()) == "hello world");
+
+        /* Mappings can be handed off */
+        MappedFile other(std::move(mapped));
+        REQUIRE(!mapped.valid());
+        REQUIRE(other.size() == 11);
+
+        /* Empty files are fine, missing files and directories aren't */
+        Path::touch("foo/empty");
+        REQUIRE(Path("foo/empty").map().valid());
+        REQUIRE(Path("foo/empty").map().empty());
+        REQUIRE(!Path("foo/whiz").map().valid());
+        REQUIRE(!Path("foo").map().valid());
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("read_all", "Make sure we can read and write whole files") {
+        Path::makedirs("foo");
+        REQUIRE(Path::write_all("foo/bar", "hello world"));
+        std::string contents;
+        REQUIRE(Path("foo/bar").read_all(contents));
+        REQUIRE(contents == "hello world");
+
+        /* Large files */
+        std::string big((3 << 20) + 17, 'a');
+        big[big.size() - 1] = 'z';
+        REQUIRE(Path::write_all("foo/bar", big));
+        REQUIRE(Path("foo/bar").read_all(contents));
+        REQUIRE(contents == big);
+
+        /* Files of the expected size are read without growing the buffer */
+        std::string medium(100000, 'm');
+        REQUIRE(Path::write_all("foo/bar", medium));
+        std::string fresh;
+        REQUIRE(Path("foo/bar").read_all(fresh));
+        REQUIRE(fresh == medium);
+        REQUIRE(fresh.capacity() < 2 * medium.size());
+
+        /* Files that don't report a size are still read in full */
+        REQUIRE(Path("/proc/self/status").read_all(contents));
+        REQUIRE(contents.find("Name:") == 0);
+        /* ... even when they take many short reads */
+        REQUIRE(Path("/proc/self/smaps").read_all(contents));
+        std::ifstream smaps("/proc/self/smaps");
+        std::string expected((std::istreambuf_iterator<char>(smaps)),
+            std::istreambuf_iterator<char>());
+        REQUIRE(expected.size() > 4096);
+        /* Sizes within mappings change as pages are touched, but the
+         * mappings themselves don't */
+        REQUIRE(std::count(contents.begin(), contents.end(), '\n') ==
+            std::count(expected.begin(), expected.end(), '\n'));
+        REQUIRE(contents.substr(0, 64) == expected.substr(0, 64));
+
+        REQUIRE(Path::write_all("foo/bar", ""));
+        REQUIRE(Path("foo/bar").read_all(contents));
+        REQUIRE(contents == "");
+        REQUIRE(!Path("foo/whiz").read_all(contents));
+        REQUIRE(!Path("foo").read_all(contents));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("atomic_write", "Make sure we can atomically replace files") {
+        Path::makedirs("foo");
+        REQUIRE(Path::atomic_write("foo/bar", "hello"));
+        REQUIRE(slurp("foo/bar") == "hello");
+        REQUIRE(Path::atomic_write("foo/bar", "world", Path::SYNC_NONE));
+        REQUIRE(slurp("foo/bar") == "world");
+        REQUIRE(Path::atomic_write("foo/bar", "again", Path::SYNC_DATA));
+        REQUIRE(slurp("foo/bar") == "again");
+
+        /* No temporary files are left behind */
+        REQUIRE(Path::listdir("foo").size() == 1);
+
+        /* Can't write into a directory that doesn't exist */
+        REQUIRE(!Path::atomic_write("foo/whiz/bar", "hello"));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("WriteBatch", "Make sure group commits work") {
+        Path::makedirs("foo/a");
+        Path::makedirs("foo/b");
+        spit("foo/a/0", "old");
+        {
+            WriteBatch batch;
+            for (int i = 0; i < 10; ++i) {
+                REQUIRE(batch.add(Path("foo/a") << i, std::to_string(i)));
+                REQUIRE(batch.add(Path("foo/b") << i, std::to_string(i)));
+            }
+            REQUIRE(batch.size() == 20);
+
+            /* Nothing is visible until it's committed */
+            REQUIRE(slurp("foo/a/0") == "old");
+            REQUIRE(!Path("foo/b/0").exists());
+
+            REQUIRE(batch.commit());
+            REQUIRE(batch.size() == 0);
+            for (int i = 0; i < 10; ++i) {
+                REQUIRE(slurp(Path("foo/a") << i) == std::to_string(i));
+                REQUIRE(slurp(Path("foo/b") << i) == std::to_string(i));
+            }
+            REQUIRE(Path::listdir("foo/a").size() == 10);
+
+            /* Uncommitted writes are thrown away */
+            REQUIRE(batch.add("foo/a/0", "new"));
+        }
+        REQUIRE(slurp("foo/a/0") == "0");
+        REQUIRE(Path::listdir("foo/a").size() == 10);
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("PathWatcher", "Make sure we see changes with inotify") {
+        Path::makedirs("foo");
+        PathWatcher watcher;
+        REQUIRE(watcher.backend() == PathWatcher::INOTIFY);
+        REQUIRE(watcher.add("foo"));
+        REQUIRE(!watcher.add("foo/whiz"));
+        REQUIRE(watcher.poll(0).empty());
+
+        /* Created and then modified is just created, and a file that comes
+         * and goes isn't reported at all */
+        Path::touch("foo/a");
+        spit("foo/a", "hello");
+        Path::touch("foo/e");
+        Path::rm("foo/e");
+        /* Things created in new directories are seen too */
+        Path::makedirs("foo/b");
+        Path::touch("foo/b/c");
+
+        std::vector<PathWatcher::Event> events(watcher.poll(1000));
+        REQUIRE(events.size() == 3);
+        REQUIRE(has_event(events, PathWatcher::Event::CREATED, "foo/a"));
+        REQUIRE(has_event(events, PathWatcher::Event::CREATED, "foo/b"));
+        REQUIRE(has_event(events, PathWatcher::Event::CREATED, "foo/b/c"));
+
+        /* The new directory is being watched */
+        spit("foo/b/c", "hello");
+        events = watcher.poll(1000);
+        REQUIRE(events.size() == 1);
+        REQUIRE(has_event(events, PathWatcher::Event::MODIFIED, "foo/b/c"));
+
+        /* Renames keep track of where things came from */
+        REQUIRE(Path::move("foo/b", "foo/d"));
+        events = watcher.poll(1000);
+        REQUIRE(events.size() == 1);
+        REQUIRE(has_event(events, PathWatcher::Event::MOVED, "foo/d"));
+        REQUIRE(events[0].from == Path("foo/b").absolute());
+
+        /* And the moved directory is still watched, under its new name */
+        REQUIRE(Path::rm("foo/d/c"));
+        events = watcher.poll(1000);
+        REQUIRE(events.size() == 1);
+        REQUIRE(has_event(events, PathWatcher::Event::DELETED, "foo/d/c"));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("PathWatcher scan", "Make sure we see changes by scanning") {
+        Path::makedirs("foo/b");
+        Path::touch("foo/b/c");
+        PathWatcher watcher(PathWatcher::SCAN, 10);
+        REQUIRE(watcher.backend() == PathWatcher::SCAN);
+        REQUIRE(watcher.add("foo"));
+        REQUIRE(watcher.poll(50).empty());
+
+        Path::touch("foo/a");
+        spit("foo/b/c", "hello");
+        std::vector<PathWatcher::Event> events(watcher.poll(1000));
+        REQUIRE(events.size() == 2);
+        REQUIRE(has_event(events, PathWatcher::Event::CREATED, "foo/a"));
+        REQUIRE(has_event(events, PathWatcher::Event::MODIFIED, "foo/b/c"));
+
+        REQUIRE(Path::rmdirs("foo/b"));
+        events = watcher.poll(1000);
+        REQUIRE(events.size() == 2);
+        REQUIRE(has_event(events, PathWatcher::Event::DELETED, "foo/b"));
+        REQUIRE(has_event(events, PathWatcher::Event::DELETED, "foo/b/c"));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("Snapshot", "Make sure snapshots record and diff trees") {
+        Path::makedirs("foo/a/b");
+        Path::makedirs("foo/c");
+        spit("foo/a/one", "1");
+        spit("foo/a/b/two", "22");
+        spit("foo/c/three", "333");
+        REQUIRE(symlink("a", "foo/link") == 0);
+
+        /* Make the directories old enough that they're trusted */
+        struct timespec times[2] = { {1000, 0}, {1000, 0} };
+        const char* dirs[] = { "foo", "foo/a", "foo/a/b", "foo/c" };
+        for (size_t i = 0; i < 4; ++i) {
+            utimensat(AT_FDCWD, dirs[i], times, 0);
+        }
+
+        Snapshot snapshot;
+        REQUIRE(!Snapshot::take("foo/whiz", snapshot));
+        REQUIRE(Snapshot::take("foo", snapshot));
+        REQUIRE(snapshot.size() == 8);
+        REQUIRE(snapshot.root() == Path("foo").absolute());
+        REQUIRE(snapshot[0].type == Snapshot::DIRECTORY);
+
+        /* Entries know where they are */
+        bool found = false;
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            if (snapshot.name(i) == "two") {
+                found = true;
+                REQUIRE(snapshot[i].size == 2);
+                REQUIRE(snapshot[i].type == Snapshot::FILE);
+                REQUIRE(snapshot.path(i) == Path("foo/a/b/two").absolute());
+            }
+        }
+        REQUIRE(found);
+
+        /* It survives a round trip through a file */
+        REQUIRE(snapshot.save("snapshot"));
+        Snapshot loaded;
+        REQUIRE(loaded.load("snapshot"));
+        REQUIRE(loaded.size() == snapshot.size());
+        REQUIRE(loaded.root() == snapshot.root());
+        for (size_t i = 0; i < loaded.size(); ++i) {
+            REQUIRE(loaded.path(i) == snapshot.path(i));
+            REQUIRE(loaded[i].ino == snapshot[i].ino);
+        }
+        REQUIRE(!loaded.load("foo/a/one"));
+
+        /* Corrupt snapshots are rejected, before anything can scan them */
+        std::string original(slurp("snapshot"));
+        uint64_t root_size;
+        memcpy(&root_size, &original[40], sizeof(root_size));
+        size_t records_at = (48 + root_size + 7) & ~size_t(7);
+        size_t record = records_at + sizeof(Snapshot::Record);
+        size_t name = records_at + snapshot.size() * sizeof(Snapshot::Record) +
+            snapshot[1].name;
+        auto corrupt = [&](size_t offset, const void* value, size_t size,
+            uint32_t name_size) {
+            std::string contents(original);
+            memcpy(&contents[offset], value, size);
+            memcpy(&contents[record + 28], &name_size, sizeof(name_size));
+            spit("snapshot", contents);
+            Snapshot broken;
+            if (broken.load("snapshot")) {
+                /* Updating it could scan without end */
+                return false;
+            }
+            return true;
+        };
+        uint32_t name_size = snapshot[1].name_size;
+        /* A count large enough to overflow the size of the records */
+        uint64_t huge = UINT64_MAX / sizeof(Snapshot::Record) + 2;
+        REQUIRE(corrupt(16, &huge, sizeof(huge), name_size));
+        /* A record that's its own parent */
+        uint32_t self = 1;
+        REQUIRE(corrupt(record + 40, &self, sizeof(self), name_size));
+        /* A directory whose children come before it */
+        uint32_t first = 0;
+        REQUIRE(corrupt(records_at + 32, &first, sizeof(first), name_size));
+        /* A root that isn't absolute, or has a NUL in it */
+        REQUIRE(corrupt(48, "x", 1, name_size));
+        REQUIRE(corrupt(49, "", 1, name_size));
+        /* Names that aren't a single segment */
+        REQUIRE(corrupt(name, "", 0, 0));
+        REQUIRE(corrupt(name, "/", 1, name_size));
+        REQUIRE(corrupt(name, "", 1, name_size));
+        REQUIRE(corrupt(name, ".", 1, 1));
+        REQUIRE(corrupt(name, "..", 2, 2));
+        /* A type that isn't one of Type */
+        uint32_t type = Snapshot::OTHER + 1;
+        REQUIRE(corrupt(record + 44, &type, sizeof(type), name_size));
+        /* ... while the unchanged snapshot still loads */
+        REQUIRE(!corrupt(0, original.data(), 0, name_size));
+        spit("snapshot", original);
+        REQUIRE(loaded.load("snapshot"));
+
+        /* Nothing changed */
+        Snapshot next;
+        Snapshot::Diff diff;
+        REQUIRE(loaded.update(next, diff));
+        REQUIRE(diff.added.empty());
+        REQUIRE(diff.removed.empty());
+        REQUIRE(diff.modified.empty());
+
+        /* Change some things */
+        Path::touch("foo/a/b/new");
+        Path::rm("foo/a/one");
+        Path::rmdirs("foo/c");
+        Path::makedirs("foo/d");
+        Path::touch("foo/d/four");
+        spit("foo/a/b/two", "twotwo");
+
+        diff = Snapshot::Diff();
+        REQUIRE(loaded.update(next, diff));
+        REQUIRE(diff.added.size() == 3);
+        REQUIRE(has_path(diff.added, "foo/a/b/new"));
+        REQUIRE(has_path(diff.added, "foo/d"));
+        REQUIRE(has_path(diff.added, "foo/d/four"));
+        REQUIRE(diff.removed.size() == 3);
+        REQUIRE(has_path(diff.removed, "foo/a/one"));
+        REQUIRE(has_path(diff.removed, "foo/c"));
+        REQUIRE(has_path(diff.removed, "foo/c/three"));
+        REQUIRE(diff.modified.size() == 1);
+        REQUIRE(has_path(diff.modified, "foo/a/b/two"));
+        REQUIRE(next.size() == 8);
+
+        /* Files in an unchanged directory are only checked when asked */
+        times[0].tv_sec = times[1].tv_sec = 2000;
+        utimensat(AT_FDCWD, "foo/d", times, 0);
+        utimensat(AT_FDCWD, "foo", times, 0);
+        REQUIRE(loaded.update(next, diff));
+        REQUIRE(next.save("snapshot"));
+        REQUIRE(loaded.load("snapshot"));
+        spit("foo/d/four", "4444");
+        diff = Snapshot::Diff();
+        REQUIRE(loaded.update(next, diff));
+        REQUIRE(diff.modified.empty());
+        diff = Snapshot::Diff();
+        REQUIRE(loaded.update(next, diff, true));
+        REQUIRE(diff.modified.size() == 1);
+        REQUIRE(has_path(diff.modified, "foo/d/four"));
+
+        REQUIRE(Path::rm("snapshot"));
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("PathTrie", "Make sure tries map paths by segment") {
+        PathTrie<int> trie;
+        REQUIRE(trie.empty());
+        REQUIRE(trie.insert("/", 0));
+        REQUIRE(trie.insert("/a/b", 1));
+        REQUIRE(trie.insert("/a/b/c/d", 2));
+        REQUIRE(trie.insert("a/b", 3));
+        REQUIRE(!trie.insert("/a//b/", 4));
+        REQUIRE(trie.size() == 4);
+
+        /* Exact matches */
+        REQUIRE(*trie.find("/a/b") == 4);
+        REQUIRE(*trie.find("a/b") == 3);
+        REQUIRE(*trie.find("/") == 0);
+        REQUIRE(trie.find("/a") == NULL);
+        REQUIRE(trie.find("/a/b/c") == NULL);
+        *trie.find("/a/b") = 1;
+
+        /* Prefixes are only matched by whole segments */
+        size_t depth = 0;
+        REQUIRE(*trie.longest_prefix("/a/b/c", &depth) == 1);
+        REQUIRE(depth == 3);
+        REQUIRE(*trie.longest_prefix("/a/bc") == 0);
+        REQUIRE(*trie.longest_prefix("/a/b/c/d/e/f") == 2);
+        REQUIRE(*trie.longest_prefix("a/b/c") == 3);
+        REQUIRE(trie.longest_prefix("b/c") == NULL);
+
+        /* Everything under a prefix, in order */
+        std::vector<std::string> keys;
+        trie.for_each("/a", [&](const Path& key, int value) {
+            keys.push_back(key.string());
+        });
+        REQUIRE(keys.size() == 2);
+        REQUIRE(keys[0] == "/a/b");
+        REQUIRE(keys[1] == "/a/b/c/d");
+
+        /* Frozen copies answer the same way */
+        PathTrie<int>::Frozen frozen(trie.freeze());
+        REQUIRE(frozen.size() == 4);
+        REQUIRE(*frozen.find("/a/b") == 1);
+        REQUIRE(*frozen.find("a/b") == 3);
+        REQUIRE(frozen.find("/a") == NULL);
+        REQUIRE(*frozen.longest_prefix("/a/b/c", &depth) == 1);
+        REQUIRE(depth == 3);
+        REQUIRE(*frozen.longest_prefix("/a/bc") == 0);
+        REQUIRE(*frozen.longest_prefix("/a/b/c/d/e/f") == 2);
+        REQUIRE(frozen.longest_prefix("b/c") == NULL);
+        keys.clear();
+        frozen.for_each("", [&](const Path& key, int value) {
+            keys.push_back(key.string());
+        });
+        REQUIRE(keys.size() == 4);
+        REQUIRE(keys[0] == "/");
+        REQUIRE(keys[3] == "a/b");
+
+        /* Erasing prunes, and leaves other keys alone */
+        REQUIRE(trie.erase("/a/b/c/d"));
+        REQUIRE(!trie.erase("/a/b/c/d"));
+        REQUIRE(!trie.erase("/a"));
+        REQUIRE(trie.size() == 3);
+        REQUIRE(*trie.longest_prefix("/a/b/c/d/e/f") == 1);
+        REQUIRE(trie.erase("/"));
+        REQUIRE(trie.longest_prefix("/a/bc") == NULL);
+        REQUIRE(*frozen.longest_prefix("/a/bc") == 0);
+    }
+
+    SECTION("canonical", "Make sure we can resolve symlinks") {
+        Path::makedirs("foo/real/sub");
+        Path::touch("foo/real/file");
+        REQUIRE(symlink("real", "foo/link") == 0);
+        REQUIRE(symlink("link/sub", "foo/chain") == 0);
+        REQUIRE(symlink("loop", "foo/loop") == 0);
+
+        char* buf = realpath("foo/real", NULL);
+        Path real(buf);
+        free(buf);
+
+        CanonicalCache cache;
+        REQUIRE(Path("foo/link/file").canonical(cache) ==
+            Path(real).append("file"));
+        REQUIRE(Path("foo/link/sub/../file").canonical(cache) ==
+            Path(real).append("file"));
+        REQUIRE(Path("foo/chain/..").canonical(cache) == real);
+        REQUIRE(Path("foo/./link//sub/").canonical(cache) ==
+            Path(real).append("sub"));
+        REQUIRE(Path(real).append("sub").canonical(cache) ==
+            Path(real).append("sub"));
+        REQUIRE(Path("/").canonical(cache) == "/");
+
+        /* Whatever doesn't exist is just sanitized */
+        REQUIRE(Path("foo/link/whiz/../bang/").canonical(cache) ==
+            Path(real).append("bang"));
+        REQUIRE(Path("foo/loop/a").canonical(cache) ==
+            Path(real).parent().append("loop/a"));
+
+        /* Resolved directories are remembered, even without a cache */
+        REQUIRE(cache.size() > 0);
+        REQUIRE(Path("foo/link/file").canonical() ==
+            Path(real).append("file"));
+        std::string resolved;
+        REQUIRE(cache.lookup(Path("foo/link").absolute().string(), resolved));
+        REQUIRE(resolved == real.string());
+
+        /* Entries can expire */
+        CanonicalCache brief(16, std::chrono::milliseconds(1));
+        brief.store("/a", "/b");
+        REQUIRE(brief.lookup("/a", resolved));
+        usleep(5000);
+        REQUIRE(!brief.lookup("/a", resolved));
+
+        /* And the cache is bounded */
+        CanonicalCache small(8);
+        for (int i = 0; i < 100; ++i) {
+            small.store(std::to_string(i), "x");
+        }
+        REQUIRE(small.size() <= 8);
+        REQUIRE(small.lookup("99", resolved));
+
+        REQUIRE(Path("foo/link/file").equivalent_physical("foo/real/file"));
+        REQUIRE(!Path("foo/link/file").equivalent("foo/real/file"));
+        REQUIRE(!Path("foo/link").equivalent_physical("foo/real/file"));
+        REQUIRE(!Path("foo/whiz").equivalent_physical("foo/whiz"));
+
+        REQUIRE(Path::rm("foo/link"));
+        REQUIRE(Path::rm("foo/chain"));
+        REQUIRE(Path::rm("foo/loop"));
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("Directory", "Make sure directory handles work") {
+        Path::makedirs("foo");
+        Directory dir("foo");
+        REQUIRE(dir.valid());
+        REQUIRE(dir.path() == "foo");
+        REQUIRE(!Directory("foo/whiz").valid());
+
+        /* Everything is relative to the directory */
+        REQUIRE(dir.makedirs("a/b/c"));
+        REQUIRE(Path("foo/a/b/c").is_directory());
+        REQUIRE(dir.touch("a/b/c/d"));
+        REQUIRE(dir.touch("e/f"));
+        REQUIRE(Path("foo/e/f").is_file());
+        REQUIRE(dir.exists("a/b"));
+        REQUIRE(dir.is_directory("a/b"));
+        REQUIRE(!dir.is_file("a/b"));
+        REQUIRE(dir.is_file("e/f"));
+        REQUIRE(!dir.exists("whiz"));
+
+        struct stat buf;
+        REQUIRE(dir.stat("a/b/c/d", buf));
+        REQUIRE(S_ISREG(buf.st_mode));
+
+        /* Listing gives names */
+        std::vector<Path> names(dir.listdir());
+        REQUIRE(names.size() == 2);
+        REQUIRE((names[0] == "a" || names[0] == "e"));
+        REQUIRE(dir.listdir().size() == 2);
+        /* ... without moving the handle's own offset */
+        REQUIRE(::lseek(dir.descriptor(), 0, SEEK_CUR) == 0);
+
+        /* Child handles */
+        Directory child(dir.open("a/b"));
+        REQUIRE(child.valid());
+        REQUIRE(child.path() == "foo/a/b");
+        REQUIRE(child.is_file("c/d"));
+        REQUIRE(!dir.open("e/f").valid());
+
+        /* Moving, within and between directories */
+        REQUIRE(dir.move("e/f", "e/g"));
+        REQUIRE(!dir.move("e/g", "h/i"));
+        REQUIRE(dir.move("e/g", "h/i", true));
+        REQUIRE(Path("foo/h/i").is_file());
+        REQUIRE(dir.move_to("h/i", child, "i"));
+        REQUIRE(Path("foo/a/b/i").is_file());
+
+        /* Handles follow their directory when it's renamed */
+        REQUIRE(Path::move("foo/a", "foo/z"));
+        REQUIRE(child.is_file("i"));
+        REQUIRE(child.touch("j"));
+        REQUIRE(Path("foo/z/b/j").is_file());
+
+        /* Globbing */
+        std::vector<Path> matches(dir.glob("*/b/?"));
+        REQUIRE(matches.size() == 3);
+        REQUIRE(matches[0] == "z/b/c");
+        REQUIRE(matches[1] == "z/b/i");
+        REQUIRE(matches[2] == "z/b/j");
+        REQUIRE(dir.glob("z/b/c/d").size() == 1);
+        REQUIRE(dir.glob("z/*/x*").empty());
+        REQUIRE(child.glob(
+            Path("foo/z/b/*").absolute().string()).size() == 3);
+
+        /* Removing files and empty directories */
+        REQUIRE(child.rm("j"));
+        REQUIRE(!child.exists("j"));
+        REQUIRE(dir.rm("e"));
+        REQUIRE(!dir.rm("z"));
+
+        /* Handles can be handed off */
+        Directory other(std::move(dir));
+        REQUIRE(!dir.valid());
+        REQUIRE(other.exists("z"));
+
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("tree_stats", "Make sure we can total up directory trees") {
+        Path::makedirs("foo/a/b");
+        Path::makedirs("foo/c");
+        spit("foo/one", "1");
+        spit("foo/a/two", "22");
+        spit("foo/a/b/three", "333");
+        spit("foo/c/four", "4444");
+        REQUIRE(symlink("one", "foo/link") == 0);
+        /* Hard links are only counted once */
+        REQUIRE(link("foo/c/four", "foo/a/b/four") == 0);
+
+        for (size_t threads = 1; threads <= 4; threads *= 2) {
+            Path::TreeStats stats(Path::tree_stats("foo", false, threads));
+            REQUIRE(stats.files == 4);
+            REQUIRE(stats.directories == 4);
+            REQUIRE(stats.symlinks == 1);
+            REQUIRE(stats.others == 0);
+            REQUIRE(stats.entries_by_depth.size() == 4);
+            REQUIRE(stats.entries_by_depth[0] == 1);
+            REQUIRE(stats.entries_by_depth[1] == 4);
+            /* Whichever of the hard links is seen first is counted */
+            REQUIRE(stats.entries_by_depth[2] +
+                stats.entries_by_depth[3] == 4);
+
+            /* Directory sizes vary by filesystem, but the files don't */
+            struct stat buf;
+            unsigned long long dirs = 0;
+            const char* paths[] = { "foo", "foo/a", "foo/a/b", "foo/c" };
+            for (size_t i = 0; i < 4; ++i) {
+                REQUIRE(lstat(paths[i], &buf) == 0);
+                dirs += buf.st_size;
+            }
+            REQUIRE(stats.bytes == dirs + 1 + 2 + 3 + 4 + 3);
+            REQUIRE(stats.allocated > 0);
+        }
+
+        REQUIRE(Path::tree_stats("foo", true).files == 4);
+        REQUIRE(Path::tree_stats("foo/whiz").directories == 0);
+
+        REQUIRE(Path::rm("foo/link"));
+        REQUIRE(Path::rmdirs("foo"));
+        REQUIRE(!Path("foo").exists());
+    }
+
+    SECTION("PathList", "Make sure we can write and read path lists") {
+        std::vector<std::string> paths;
+        std::string joined;
+        for (size_t i = 0; i < 500; ++i) {
+            paths.push_back("/home/user/projects/apathy/build/objects/" +
+                std::to_string(i / 50) + "/file" + std::to_string(i));
+            joined += paths.back() + "\n";
+        }
+        paths.push_back("/home/user/projects/apathy/build/objects/9/file499");
+        paths.push_back("");
+        paths.push_back("relative");
+
+        std::ostringstream out;
+        {
+            PathListWriter writer(out, 16);
+            for (size_t i = 0; i < paths.size(); ++i) {
+                REQUIRE(writer.add(paths[i]));
+            }
+            REQUIRE(writer.size() == paths.size());
+        }
+        std::string encoded(out.str());
+        REQUIRE(encoded.size() < joined.size() / 3);
+
+        /* Reading in order from memory */
+        PathListReader reader(encoded.data(), encoded.size());
+        REQUIRE(reader.valid());
+        REQUIRE(reader.indexed());
+        REQUIRE(reader.size() == paths.size());
+        REQUIRE(reader.block_size() == 16);
+        REQUIRE(reader.blocks() == (paths.size() + 15) / 16);
+        PathView view;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            REQUIRE(reader.next(view));
+            REQUIRE(view.string() == paths[i]);
+        }
+        REQUIRE(!reader.next(view));
+
+        /* Jumping to a block */
+        REQUIRE(reader.seek(3));
+        REQUIRE(reader.next(view));
+        REQUIRE(view.string() == paths[48]);
+        REQUIRE(reader.next(view));
+        REQUIRE(view.string() == paths[49]);
+        REQUIRE(!reader.seek(reader.blocks()));
+
+        /* Streaming */
+        std::istringstream in(encoded);
+        PathListDecoder decoder(in);
+        REQUIRE(decoder.valid());
+        size_t count = 0;
+        while (decoder.next(view)) {
+            REQUIRE(view.string() == paths[count++]);
+        }
+        REQUIRE(count == paths.size());
+        REQUIRE(decoder.valid());
+
+        /* Files, and lists without an index */
+        std::vector<Path> listed(paths.begin(), paths.begin() + 100);
+        REQUIRE(PathListWriter::save("foo.list", listed));
+        std::vector<Path> loaded;
+        REQUIRE(PathListReader::load("foo.list", loaded));
+        REQUIRE(loaded.size() == 100);
+        for (size_t i = 0; i < loaded.size(); ++i) {
+            REQUIRE(loaded[i].string() == paths[i]);
+        }
+        /* Loading appends, without sharing a prefix with what's there */
+        REQUIRE(PathListReader::load("foo.list", loaded));
+        REQUIRE(loaded.size() == 200);
+        REQUIRE(loaded[100].string() == paths[0]);
+        REQUIRE(loaded[199].string() == paths[99]);
+
+        std::ostringstream unindexed;
+        PathListWriter(unindexed, 16, false).add(paths[0]);
+        std::string plain(unindexed.str());
+        PathListReader sequential(plain.data(), plain.size());
+        REQUIRE(sequential.valid());
+        REQUIRE(!sequential.indexed());
+        REQUIRE(!sequential.seek(0));
+        REQUIRE(sequential.next(view));
+        REQUIRE(view.string() == paths[0]);
+
+        /* Malformed lists */
+        REQUIRE(!PathListReader(encoded.data(), encoded.size() - 1).valid());
+        std::string corrupt(encoded);
+        corrupt[pathlist::header_size] = 0x7F;
+        PathListReader broken(corrupt.data(), corrupt.size());
+        REQUIRE(broken.valid());
+        REQUIRE(!broken.next(view));
+        std::istringstream garbage("not a path list");
+        REQUIRE(!PathListDecoder(garbage).valid());
+        /* A suffix length far beyond the end of the stream */
+        std::string huge(encoded.substr(0, pathlist::header_size));
+        huge += std::string("\x01\xff\xff\xff\xff\xff\xff\xff\x7f", 9);
+        huge += "abc";
+        std::istringstream truncated(huge);
+        PathListDecoder overlong(truncated);
+        REQUIRE(overlong.valid());
+        REQUIRE(!overlong.next(view));
+        REQUIRE(!overlong.valid());
+        REQUIRE(!PathListReader("nonexistent.list").valid());
+
+        REQUIRE(Path::rm("foo.list"));
+    }
+
+    SECTION("PathSort", "Make sure we can sort paths hierarchically") {
+        PathLess less;
+        REQUIRE(less(Path("/a"), Path("/a/b")));
+        REQUIRE(less(Path("/a/b"), Path("/a-b")));
+        REQUIRE(less(Path("/a/b/c"), Path("/a-b")));
+        REQUIRE(less(Path("/a-b"), Path("/ab")));
+        REQUIRE(!less(Path("/a"), Path("/a")));
+        REQUIRE(PathLess::compare("/a/b", "/a/c", 3) < 0);
+        REQUIRE(PathLess::compare("/a/bcdefghijk/", "/a/bcdefghijk") > 0);
+        REQUIRE(PathLess::compare("/a/bcdefghijk/", "/a/bcdefghijk-") < 0);
+
+        std::vector<Path> paths;
+        for (size_t i = 0; i < 40000; ++i) {
+            size_t n = (i * 7919) % 40000;
+            paths.push_back(Path("/data").append(
+                std::to_string(n % 13)).append(std::to_string(n % 101) +
+                (n % 3 ? "-x" : "")).append(std::to_string(n)));
+        }
+        paths.push_back(Path("/data/1"));
+        paths.push_back(Path("/data/1"));
+        paths.push_back(Path("/data"));
+        paths.push_back(Path(""));
+
+        auto same = [](const std::vector<Path>& a,
+            const std::vector<Path>& b) {
+            for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+                if (a[i].string() != b[i].string()) {
+                    return false;
+                }
+            }
+            return a.size() == b.size();
+        };
+        std::vector<Path> expected(paths);
+        std::sort(expected.begin(), expected.end(), less);
+        for (size_t threads = 1; threads <= 3; ++threads) {
+            std::vector<Path> sorted(paths);
+            PathSort::sort(sorted, threads);
+            REQUIRE(same(sorted, expected));
+        }
+
+        /* Merging sorted runs */
+        std::vector<std::vector<Path> > runs(3);
+        for (size_t i = 0; i < expected.size(); ++i) {
+            runs[i % 3].push_back(expected[i]);
+        }
+        runs.push_back(std::vector<Path>());
+        std::vector<Path> merged;
+        PathSort::merge(runs, merged);
+        REQUIRE(runs[0].empty());
+        REQUIRE(same(merged, expected));
+
+        /* Deduplicating */
+        REQUIRE(PathSort::unique(merged) == 1);
+        REQUIRE(merged.size() == expected.size() - 1);
+        REQUIRE(std::adjacent_find(merged.begin(), merged.end(),
+            [&less](const Path& a, const Path& b) {
+                return !less(a, b);
+            }) == merged.end());
+
+        std::vector<Path> spellings;
+        spellings.push_back(Path("foo/bar/"));
+        spellings.push_back(Path("foo//bar"));
+        spellings.push_back(Path("foo/./bar"));
+        spellings.push_back(Path("foo"));
+        spellings.push_back(Path("foo/baz/../bar"));
+        spellings.push_back(Path("/"));
+        spellings.push_back(Path("//"));
+        REQUIRE(PathSort::unique(spellings, true) == 4);
+        REQUIRE(spellings.size() == 3);
+        REQUIRE(spellings[0].string() == "/");
+        REQUIRE(spellings[1].string() == "foo");
+        REQUIRE(spellings[2].string() == "foo/bar");
+
+        std::vector<Path> empty;
+        PathSort::sort(empty);
+        REQUIRE(PathSort::unique(empty) == 0);
+    }
+
+    SECTION("create", "Make sure we can create many files at once") {
+        spit("existing", "contents");
+
+        std::vector<Path::FileSpec> files;
+        files.push_back(Path::FileSpec("foo/a/one"));
+        files.push_back(Path::FileSpec("foo/a/two", 0600, 4096));
+        files.push_back(Path::FileSpec("foo/b/c/three", 0644, 100));
+        files.push_back(Path::FileSpec("existing", 0666, 4));
+        files.push_back(Path::FileSpec("existing/nested"));
+        files.push_back(Path::FileSpec("relative"));
+        for (size_t i = 0; i < 1000; ++i) {
+            files.push_back(Path::FileSpec(
+                Path("foo/many").append(i % 3).append(i), 0666, i % 2));
+        }
+
+        for (size_t threads = 1; threads <= 2; ++threads) {
+            std::vector<int> results(Path::create(files, threads));
+            REQUIRE(results.size() == files.size());
+            REQUIRE(results[0] == 0);
+            REQUIRE(results[1] == 0);
+            REQUIRE(results[2] == 0);
+            REQUIRE(results[3] == 0);
+            REQUIRE(results[4] == ENOTDIR);
+            REQUIRE(results[5] == 0);
+            REQUIRE(std::count(results.begin(), results.end(), 0) ==
+                static_cast<long>(files.size() - 1));
+        }
+
+        REQUIRE(Path("foo/a/one").is_file());
+        REQUIRE(Path("foo/a/one").size() == 0);
+        REQUIRE(Path("foo/a/two").size() == 4096);
+        REQUIRE(Path("foo/b/c/three").size() == 100);
+        REQUIRE(Path("relative").is_file());
+        REQUIRE(Path("foo/many/2/998").size() == 0);
+        REQUIRE(Path("foo/many/0/999").size() == 1);
+        REQUIRE(Path::listdir("foo/many/0").size() == 334);
+
+        struct stat buf;
+        REQUIRE(stat("foo/a/two", &buf) == 0);
+        REQUIRE((buf.st_mode & 0777) == 0600);
+
+        /* Existing files are left alone, rather than truncated */
+        REQUIRE(slurp("existing") == "contents");
+
+        REQUIRE(Path::create(std::vector<Path::FileSpec>()).empty());
+        REQUIRE(Path::rm("existing"));
+        REQUIRE(Path::rm("relative"));
+        REQUIRE(Path::rmdirs("foo"));
+    }
 }
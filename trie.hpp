@@ -0,0 +1,553 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef APATHY__TRIE_HPP
+#define APATHY__TRIE_HPP
+
+/* C++ includes */
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+/* C includes */
+#include <stdint.h>
+
+/* Internal libraries */
+#include "path.hpp"
+
+namespace apathy {
+    /* A map from paths to values, organized by path segment
+     *
+     * Keys are split into segments the same way as `Path::split`, except that
+     * empty segments (from repeated or trailing separators) are ignored, so
+     * "/a//b/" and "/a/b" are the same key. Segments are compared exactly, so
+     * keys should be sanitized first if they may contain '.' or '..'.
+     *
+     * Lookups take time proportional to the number of segments in the key,
+     * regardless of how many keys there are. The most useful of these is
+     * `longest_prefix`, which finds the most specific key that contains a
+     * path, as when routing paths to handlers or mount points.
+     *
+     * For read-heavy use, `freeze` makes an immutable, compact copy that may
+     * be shared between threads without locking */
+    template <class T>
+    class PathTrie {
+    public:
+        class Frozen;
+
+        PathTrie(): root(new Node()), count(0) {}
+
+        PathTrie(const PathTrie& other) = delete;
+        PathTrie& operator=(const PathTrie& other) = delete;
+        PathTrie(PathTrie&& other) = default;
+        PathTrie& operator=(PathTrie&& other) = default;
+
+        /* Set the value for a key
+         *
+         * @returns true if the key is new, false if it replaced a value */
+        bool insert(const Path& key, const T& value);
+
+        /* Remove a key
+         *
+         * @returns true if the key was present */
+        bool erase(const Path& key);
+
+        /* The value for exactly this key, or NULL */
+        T* find(const Path& key);
+        const T* find(const Path& key) const;
+
+        /* The value of the longest key that is a prefix of this path (by
+         * whole segments), or NULL if there is none
+         *
+         * @param key - the path to look up
+         * @param depth - if provided, set to the number of segments matched */
+        const T* longest_prefix(const Path& key, size_t* depth=NULL) const;
+
+        /* Call f(path, value) for every key at or under a prefix, in order
+         * of segments */
+        template <class F>
+        void for_each(const Path& prefix, F f) const;
+
+        /* The number of keys */
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        /* Make an immutable, read-optimized copy */
+        Frozen freeze() const;
+
+        /* Call f(data, size) with each segment of a path, stopping early if
+         * it returns false. Absolute paths start with an empty segment.
+         * Returns false if f stopped early */
+        template <class F>
+        static bool segments(const std::string& key, F f);
+
+    private:
+        struct Node {
+            Node(): children(), value() {}
+
+            /* Children, sorted by segment */
+            std::vector<std::pair<std::string, std::unique_ptr<Node> > >
+                children;
+            /* The value, if this node is a key */
+            std::unique_ptr<T> value;
+        };
+
+        /* Find the index of a segment among children, or where it would go */
+        static size_t lower_bound(const Node& node, const char* data,
+            size_t size);
+
+        /* Find the child for a segment, or NULL */
+        static Node* child(const Node& node, const char* data, size_t size);
+
+        /* Depth-first traversal for `for_each` */
+        template <class F>
+        static void visit(const Node& node, std::string& path, F& f);
+
+        std::unique_ptr<Node> root;
+        size_t count;
+    };
+
+    /* An immutable PathTrie
+     *
+     * All of the nodes are in a single array, with each node's children
+     * contiguous and sorted, and all of the segments in a single string. As
+     * nothing changes after construction, any number of threads may read
+     * one at once (typically through a std::shared_ptr<const Frozen>) */
+    template <class T>
+    class PathTrie<T>::Frozen {
+    public:
+        Frozen(): nodes(), text(), values() {}
+
+        /* The value for exactly this key, or NULL */
+        const T* find(const Path& key) const;
+
+        /* As with PathTrie::longest_prefix */
+        const T* longest_prefix(const Path& key, size_t* depth=NULL) const;
+
+        /* As with PathTrie::for_each */
+        template <class F>
+        void for_each(const Path& prefix, F f) const;
+
+        /* The number of keys */
+        size_t size() const { return values.size(); }
+        bool empty() const { return values.empty(); }
+
+    private:
+        friend class PathTrie<T>;
+
+        struct Node {
+            /* Where this node's segment is in the text */
+            uint32_t segment;
+            uint32_t segment_size;
+            /* The range of this node's children */
+            uint32_t first;
+            uint32_t children;
+            /* Index of this node's value, or -1 */
+            int64_t value;
+        };
+
+        /* The child of a node for a segment, or -1 */
+        int64_t child(const Node& node, const char* data, size_t size) const;
+
+        /* Depth-first traversal for `for_each` */
+        template <class F>
+        void visit(const Node& node, std::string& path, F& f) const;
+
+        /* Nodes, with the root first */
+        std::vector<Node> nodes;
+        /* All the segments */
+        std::string text;
+        /* All the values */
+        std::vector<T> values;
+    };
+
+    template <class T>
+    template <class F>
+    inline bool PathTrie<T>::segments(const std::string& key, F f) {
+        size_t pos = 0;
+        if (key.size() && key[0] == Path::separator) {
+            if (!f(key.data(), 0)) {
+                return false;
+            }
+        }
+
+        while (pos < key.size()) {
+            size_t start = key.find_first_not_of(Path::separator, pos);
+            if (start == std::string::npos) {
+                break;
+            }
+
+            size_t end = key.find(Path::separator, start);
+            if (end == std::string::npos) {
+                end = key.size();
+            }
+            if (!f(key.data() + start, end - start)) {
+                return false;
+            }
+            pos = end;
+        }
+        return true;
+    }
+
+    template <class T>
+    inline size_t PathTrie<T>::lower_bound(const Node& node,
+        const char* data, size_t size) {
+        size_t low = 0;
+        size_t high = node.children.size();
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (node.children[mid].first.compare(
+                0, std::string::npos, data, size) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+    template <class T>
+    inline typename PathTrie<T>::Node* PathTrie<T>::child(const Node& node,
+        const char* data, size_t size) {
+        size_t i = lower_bound(node, data, size);
+        if (i < node.children.size() && node.children[i].first.compare(
+            0, std::string::npos, data, size) == 0) {
+            return node.children[i].second.get();
+        }
+        return NULL;
+    }
+
+    template <class T>
+    inline bool PathTrie<T>::insert(const Path& key, const T& value) {
+        Node* node = root.get();
+        segments(key.string(), [&](const char* data, size_t size) {
+            size_t i = lower_bound(*node, data, size);
+            if (i == node->children.size() || node->children[i].first.compare(
+                0, std::string::npos, data, size) != 0) {
+                node->children.insert(node->children.begin() + i,
+                    std::make_pair(std::string(data, size),
+                        std::unique_ptr<Node>(new Node())));
+            }
+            node = node->children[i].second.get();
+            return true;
+        });
+
+        if (node->value) {
+            *node->value = value;
+            return false;
+        }
+        node->value.reset(new T(value));
+        ++count;
+        return true;
+    }
+
+    template <class T>
+    inline bool PathTrie<T>::erase(const Path& key) {
+        /* Remember the path down, so that empty nodes can be pruned */
+        std::vector<std::pair<Node*, size_t> > trail;
+        Node* node = root.get();
+        bool found = segments(key.string(), [&](const char* data,
+            size_t size) {
+            size_t i = lower_bound(*node, data, size);
+            if (i == node->children.size() || node->children[i].first.compare(
+                0, std::string::npos, data, size) != 0) {
+                return false;
+            }
+            trail.push_back(std::make_pair(node, i));
+            node = node->children[i].second.get();
+            return true;
+        });
+
+        if (!found || !node->value) {
+            return false;
+        }
+
+        node->value.reset();
+        --count;
+        while (!trail.empty()) {
+            Node* parent = trail.back().first;
+            Node* leaf = parent->children[trail.back().second].second.get();
+            if (leaf->value || !leaf->children.empty()) {
+                break;
+            }
+            parent->children.erase(
+                parent->children.begin() + trail.back().second);
+            trail.pop_back();
+        }
+        return true;
+    }
+
+    template <class T>
+    inline const T* PathTrie<T>::find(const Path& key) const {
+        const Node* node = root.get();
+        bool found = segments(key.string(), [&](const char* data,
+            size_t size) {
+            node = child(*node, data, size);
+            return node != NULL;
+        });
+        return found ? node->value.get() : NULL;
+    }
+
+    template <class T>
+    inline T* PathTrie<T>::find(const Path& key) {
+        return const_cast<T*>(
+            static_cast<const PathTrie<T>&>(*this).find(key));
+    }
+
+    template <class T>
+    inline const T* PathTrie<T>::longest_prefix(const Path& key,
+        size_t* depth) const {
+        const Node* node = root.get();
+        const T* best = node->value.get();
+        size_t matched = 0;
+        size_t best_depth = 0;
+        segments(key.string(), [&](const char* data, size_t size) {
+            node = child(*node, data, size);
+            if (node == NULL) {
+                return false;
+            }
+            ++matched;
+            if (node->value) {
+                best = node->value.get();
+                best_depth = matched;
+            }
+            return true;
+        });
+
+        if (depth) {
+            *depth = best_depth;
+        }
+        return best;
+    }
+
+    template <class T>
+    template <class F>
+    inline void PathTrie<T>::visit(const Node& node, std::string& path,
+        F& f) {
+        if (node.value) {
+            f(Path(path), *node.value);
+        }
+
+        size_t length = path.size();
+        for (size_t i = 0; i < node.children.size(); ++i) {
+            if (length && path[length - 1] != Path::separator) {
+                path.push_back(Path::separator);
+            }
+            path.append(node.children[i].first);
+            /* The root segment of absolute paths is empty */
+            if (length == 0 && node.children[i].first.empty()) {
+                path.push_back(Path::separator);
+            }
+            visit(*node.children[i].second, path, f);
+            path.resize(length);
+        }
+    }
+
+    template <class T>
+    template <class F>
+    inline void PathTrie<T>::for_each(const Path& prefix, F f) const {
+        const Node* node = root.get();
+        std::string path;
+        bool found = segments(prefix.string(), [&](const char* data,
+            size_t size) {
+            node = child(*node, data, size);
+            if (node == NULL) {
+                return false;
+            }
+            if (path.size() && path[path.size() - 1] != Path::separator) {
+                path.push_back(Path::separator);
+            }
+            path.append(data, size);
+            if (size == 0) {
+                path.push_back(Path::separator);
+            }
+            return true;
+        });
+
+        if (found) {
+            visit(*node, path, f);
+        }
+    }
+
+    template <class T>
+    inline typename PathTrie<T>::Frozen PathTrie<T>::freeze() const {
+        Frozen frozen;
+        typename Frozen::Node top = { 0, 0, 0, 0, -1 };
+        frozen.nodes.push_back(top);
+
+        /* Lay the nodes out breadth first, so that each node's children end
+         * up next to each other */
+        std::vector<const Node*> queue(1, root.get());
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const Node* node = queue[i];
+            if (node->value) {
+                frozen.nodes[i].value = frozen.values.size();
+                frozen.values.push_back(*node->value);
+            }
+
+            frozen.nodes[i].first = frozen.nodes.size();
+            frozen.nodes[i].children = node->children.size();
+            for (size_t c = 0; c < node->children.size(); ++c) {
+                typename Frozen::Node next = {
+                    static_cast<uint32_t>(frozen.text.size()),
+                    static_cast<uint32_t>(node->children[c].first.size()),
+                    0, 0, -1 };
+                frozen.text.append(node->children[c].first);
+                frozen.nodes.push_back(next);
+                queue.push_back(node->children[c].second.get());
+            }
+        }
+        return frozen;
+    }
+
+    template <class T>
+    inline int64_t PathTrie<T>::Frozen::child(const Node& node,
+        const char* data, size_t size) const {
+        size_t low = node.first;
+        size_t high = node.first + node.children;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            const Node& candidate(nodes[mid]);
+            int order = memcmp(text.data() + candidate.segment, data,
+                std::min<size_t>(candidate.segment_size, size));
+            if (order == 0) {
+                if (candidate.segment_size == size) {
+                    return mid;
+                }
+                order = (candidate.segment_size < size) ? -1 : 1;
+            }
+
+            if (order < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return -1;
+    }
+
+    template <class T>
+    inline const T* PathTrie<T>::Frozen::find(const Path& key) const {
+        if (nodes.empty()) {
+            return NULL;
+        }
+
+        int64_t index = 0;
+        bool found = segments(key.string(), [&](const char* data,
+            size_t size) {
+            index = child(nodes[index], data, size);
+            return index >= 0;
+        });
+        if (!found || nodes[index].value < 0) {
+            return NULL;
+        }
+        return &values[nodes[index].value];
+    }
+
+    template <class T>
+    inline const T* PathTrie<T>::Frozen::longest_prefix(const Path& key,
+        size_t* depth) const {
+        if (nodes.empty()) {
+            return NULL;
+        }
+
+        int64_t index = 0;
+        int64_t best = nodes[0].value;
+        size_t matched = 0;
+        size_t best_depth = 0;
+        segments(key.string(), [&](const char* data, size_t size) {
+            index = child(nodes[index], data, size);
+            if (index < 0) {
+                return false;
+            }
+            ++matched;
+            if (nodes[index].value >= 0) {
+                best = nodes[index].value;
+                best_depth = matched;
+            }
+            return true;
+        });
+
+        if (depth) {
+            *depth = best_depth;
+        }
+        return best < 0 ? NULL : &values[best];
+    }
+
+    template <class T>
+    template <class F>
+    inline void PathTrie<T>::Frozen::visit(const Node& node,
+        std::string& path, F& f) const {
+        if (node.value >= 0) {
+            f(Path(path), values[node.value]);
+        }
+
+        size_t length = path.size();
+        for (uint32_t i = node.first; i < node.first + node.children; ++i) {
+            if (length && path[length - 1] != Path::separator) {
+                path.push_back(Path::separator);
+            }
+            path.append(text, nodes[i].segment, nodes[i].segment_size);
+            if (length == 0 && nodes[i].segment_size == 0) {
+                path.push_back(Path::separator);
+            }
+            visit(nodes[i], path, f);
+            path.resize(length);
+        }
+    }
+
+    template <class T>
+    template <class F>
+    inline void PathTrie<T>::Frozen::for_each(const Path& prefix,
+        F f) const {
+        if (nodes.empty()) {
+            return;
+        }
+
+        int64_t index = 0;
+        std::string path;
+        bool found = segments(prefix.string(), [&](const char* data,
+            size_t size) {
+            index = child(nodes[index], data, size);
+            if (index < 0) {
+                return false;
+            }
+            if (path.size() && path[path.size() - 1] != Path::separator) {
+                path.push_back(Path::separator);
+            }
+            path.append(data, size);
+            if (size == 0) {
+                path.push_back(Path::separator);
+            }
+            return true;
+        });
+
+        if (found) {
+            visit(nodes[index], path, f);
+        }
+    }
+}
+
+#endif
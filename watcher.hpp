@@ -0,0 +1,516 @@
+/******************************************************************************
+ * Copyright (c) 2013 Dan Lecocq
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef APATHY__WATCHER_HPP
+#define APATHY__WATCHER_HPP
+
+/* C++ includes */
+#include <map>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/* C includes */
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/* Internal libraries */
+#include "path.hpp"
+
+namespace apathy {
+    /* Watches directory trees for changes
+     *
+     * Roots are watched recursively, and directories created inside them are
+     * watched as they appear. On Linux this uses inotify, so the cost of a
+     * `poll` is proportional to the number of changes. Elsewhere, or if
+     * inotify is unavailable (or runs out of watches), the trees are rescanned
+     * periodically and diffed against the previous scan */
+    class PathWatcher {
+    public:
+        /* How changes are detected */
+        enum Backend {
+            /* Kernel notifications through inotify(7) */
+            INOTIFY,
+            /* Periodically rescanning and comparing */
+            SCAN
+        };
+
+        /* A single change to a path */
+        struct Event {
+            enum Type {
+                CREATED,
+                MODIFIED,
+                DELETED,
+                /* Renamed from `from` to `path`, within the watched trees */
+                MOVED,
+                /* Some events were lost, and `path` should be rescanned */
+                OVERFLOWED
+            };
+
+            Event(Type type, const Path& path, const Path& from=Path()):
+                type(type), path(path), from(from) {}
+
+            Type type;
+            Path path;
+            Path from;
+        };
+
+        /* @param backend - the preferred backend
+         * @param interval - milliseconds between rescans for the SCAN
+         *     backend */
+        PathWatcher(Backend backend=INOTIFY, int interval=1000);
+
+        ~PathWatcher();
+
+        /* Which backend is actually in use */
+        Backend backend() const { return kind; }
+
+        /* Recursively watch a directory
+         *
+         * @param root - directory to watch
+         * @returns true if the directory could be watched */
+        bool add(const Path& root);
+
+        /* Wait for changes
+         *
+         * Returns all the changes available once there's at least one, or
+         * when the timeout expires. Events for the same path are coalesced,
+         * so a file created and then modified is reported as CREATED, and one
+         * created and then deleted isn't reported at all. Paths are absolute
+         *
+         * @param timeout - milliseconds to wait, or -1 to wait indefinitely */
+        std::vector<Event> poll(int timeout=-1);
+
+    private:
+        PathWatcher(const PathWatcher& other) = delete;
+        PathWatcher& operator=(const PathWatcher& other) = delete;
+
+        /* What the scanner remembers about each path */
+        struct Entry {
+            bool operator!=(const Entry& other) const {
+                return ino != other.ino || size != other.size ||
+                    mtime != other.mtime;
+            }
+
+            ino_t ino;
+            off_t size;
+            long long mtime;
+            bool directory;
+        };
+        typedef std::map<std::string, Entry> Entries;
+
+        /* Switch to the scanning backend */
+        void fall_back();
+
+        /* Record every path under a directory */
+        void scan(const Path& dir, Entries& entries) const;
+
+        /* Rescan every root, and report the differences */
+        void rescan(std::vector<Event>& events);
+
+        /* Watch a directory and everything in it, reporting what's found
+         * inside if `report` is set */
+        bool watch(const Path& dir, std::vector<Event>* report);
+
+        /* Forget the watches on a directory and everything inside it */
+        void unwatch(const std::string& dir);
+
+        /* Read whatever inotify has for us */
+        void read_events(std::vector<Event>& events);
+
+        /* Merge events for the same path */
+        static void coalesce(std::vector<Event>& events);
+
+        /* The backend in use */
+        Backend kind;
+        /* Milliseconds between scans */
+        int interval;
+        /* The inotify descriptor */
+        int fd;
+        /* The roots being watched */
+        std::vector<Path> roots;
+        /* Watch descriptors and the directories they refer to */
+        std::map<int, std::string> watches;
+        /* The results of the last scan */
+        Entries entries;
+        /* When the last scan happened */
+        std::chrono::steady_clock::time_point scanned;
+    };
+
+    inline PathWatcher::PathWatcher(Backend backend, int interval):
+        kind(backend), interval(interval), fd(-1), roots(), watches(),
+        entries(), scanned(std::chrono::steady_clock::now()) {
+#ifdef __linux__
+        if (kind == INOTIFY) {
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+#endif
+        if (fd == -1) {
+            kind = SCAN;
+        }
+    }
+
+    inline PathWatcher::~PathWatcher() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    inline bool PathWatcher::add(const Path& root) {
+        Path abs(Path(root).absolute().trim());
+        if (!abs.is_directory()) {
+            return false;
+        }
+
+        roots.push_back(abs);
+        if (kind == SCAN) {
+            scan(abs, entries);
+        } else if (!watch(abs, NULL)) {
+            fall_back();
+        }
+        return true;
+    }
+
+    inline void PathWatcher::fall_back() {
+        if (kind == SCAN) {
+            return;
+        }
+
+        /* Take a snapshot of everything, and stop listening to the kernel */
+        kind = SCAN;
+        close(fd);
+        fd = -1;
+        watches.clear();
+        entries.clear();
+        for (size_t i = 0; i < roots.size(); ++i) {
+            scan(roots[i], entries);
+        }
+        scanned = std::chrono::steady_clock::now();
+    }
+
+    inline std::vector<PathWatcher::Event> PathWatcher::poll(int timeout) {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point deadline(clock::now() +
+            std::chrono::milliseconds(timeout));
+
+        std::vector<Event> events;
+        while (events.empty()) {
+            int wait = timeout;
+            if (timeout >= 0) {
+                wait = std::max(0L, static_cast<long>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - clock::now()).count()));
+            }
+
+            if (kind == INOTIFY) {
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                int ready = ::poll(&pfd, 1, wait);
+                if (ready > 0) {
+                    read_events(events);
+                } else if (ready < 0 && errno != EINTR) {
+                    fall_back();
+                }
+            } else {
+                /* Wait until the next scan is due, or we run out of time */
+                clock::time_point next(scanned +
+                    std::chrono::milliseconds(interval));
+                if (timeout >= 0 && deadline < next) {
+                    next = deadline;
+                }
+                std::this_thread::sleep_until(next);
+                if (clock::now() >= scanned +
+                    std::chrono::milliseconds(interval)) {
+                    rescan(events);
+                }
+            }
+
+            coalesce(events);
+            if (timeout >= 0 && clock::now() >= deadline) {
+                break;
+            }
+        }
+        return events;
+    }
+
+    inline void PathWatcher::scan(const Path& dir, Entries& entries) const {
+        std::vector<Path> children(Path::listdir(dir));
+        for (size_t i = 0; i < children.size(); ++i) {
+            struct stat buf;
+            if (lstat(children[i].string().c_str(), &buf) != 0) {
+                continue;
+            }
+
+            Entry entry;
+            entry.ino = buf.st_ino;
+            entry.size = buf.st_size;
+            entry.mtime = buf.st_mtim.tv_sec * 1000000000LL +
+                buf.st_mtim.tv_nsec;
+            entry.directory = S_ISDIR(buf.st_mode);
+            if (entry.directory) {
+                /* A directory's times change with its contents, which are
+                 * reported on their own */
+                entry.size = 0;
+                entry.mtime = 0;
+                scan(children[i], entries);
+            }
+            entries[children[i].string()] = entry;
+        }
+    }
+
+    inline void PathWatcher::rescan(std::vector<Event>& events) {
+        Entries current;
+        for (size_t i = 0; i < roots.size(); ++i) {
+            scan(roots[i], current);
+        }
+        scanned = std::chrono::steady_clock::now();
+
+        /* Both are sorted, so walk them together */
+        Entries::const_iterator old(entries.begin());
+        Entries::const_iterator now(current.begin());
+        while (old != entries.end() || now != current.end()) {
+            if (now == current.end() ||
+                (old != entries.end() && old->first < now->first)) {
+                events.push_back(Event(Event::DELETED, old->first));
+                ++old;
+            } else if (old == entries.end() || now->first < old->first) {
+                events.push_back(Event(Event::CREATED, now->first));
+                ++now;
+            } else {
+                if (old->second != now->second) {
+                    events.push_back(Event(Event::MODIFIED, now->first));
+                }
+                ++old;
+                ++now;
+            }
+        }
+        entries.swap(current);
+    }
+
+    inline bool PathWatcher::watch(const Path& dir,
+        std::vector<Event>* report) {
+#ifdef __linux__
+        uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK;
+        int wd = inotify_add_watch(fd, dir.string().c_str(), mask);
+        if (wd == -1) {
+            /* It's fine for a directory to vanish before we get to it, but
+             * running out of watches means we have to scan instead */
+            return errno == ENOENT || errno == ENOTDIR;
+        }
+        watches[wd] = dir.string();
+
+        /* Anything already inside was created before we were watching */
+        std::vector<Path> children(Path::listdir(dir));
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (report) {
+                report->push_back(Event(Event::CREATED, children[i]));
+            }
+
+            struct stat buf;
+            if (lstat(children[i].string().c_str(), &buf) == 0 &&
+                S_ISDIR(buf.st_mode) && !watch(children[i], report)) {
+                return false;
+            }
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    inline void PathWatcher::unwatch(const std::string& dir) {
+#ifdef __linux__
+        std::string prefix(dir + Path::separator);
+        std::map<int, std::string>::iterator it(watches.begin());
+        while (it != watches.end()) {
+            if (it->second == dir || it->second.compare(
+                0, prefix.size(), prefix) == 0) {
+                inotify_rm_watch(fd, it->first);
+                watches.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+#endif
+    }
+
+    inline void PathWatcher::read_events(std::vector<Event>& events) {
+#ifdef __linux__
+        /* The first half of a rename, waiting for the second half */
+        std::map<uint32_t, std::pair<Path, bool> > moved;
+
+        alignas(struct inotify_event) char buffer[1 << 16];
+        while (kind == INOTIFY) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) { continue; }
+                break;
+            }
+
+            for (char* p = buffer; p < buffer + n;) {
+                struct inotify_event* event =
+                    reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    for (size_t i = 0; i < roots.size(); ++i) {
+                        events.push_back(
+                            Event(Event::OVERFLOWED, roots[i]));
+                    }
+                    continue;
+                }
+
+                std::map<int, std::string>::iterator watched(
+                    watches.find(event->wd));
+                if (watched == watches.end()) {
+                    continue;
+                } else if (event->mask & IN_IGNORED) {
+                    watches.erase(watched);
+                    continue;
+                } else if (event->len == 0) {
+                    /* Changes to the watched directory itself are reported
+                     * by its parent */
+                    continue;
+                }
+
+                Path path(watched->second);
+                path.append(std::string(event->name));
+                bool directory = (event->mask & IN_ISDIR);
+
+                if (event->mask & IN_CREATE) {
+                    events.push_back(Event(Event::CREATED, path));
+                    if (directory && !watch(path, &events)) {
+                        fall_back();
+                    }
+                } else if (event->mask & IN_DELETE) {
+                    events.push_back(Event(Event::DELETED, path));
+                } else if (event->mask & (IN_MODIFY | IN_ATTRIB)) {
+                    events.push_back(Event(Event::MODIFIED, path));
+                } else if (event->mask & IN_MOVED_FROM) {
+                    moved[event->cookie] = std::make_pair(path, directory);
+                } else if (event->mask & IN_MOVED_TO) {
+                    std::map<uint32_t, std::pair<Path, bool> >::iterator
+                        from(moved.find(event->cookie));
+                    if (from == moved.end()) {
+                        /* Moved in from outside the watched trees */
+                        events.push_back(Event(Event::CREATED, path));
+                        if (directory && !watch(path, &events)) {
+                            fall_back();
+                        }
+                        continue;
+                    }
+
+                    events.push_back(
+                        Event(Event::MOVED, path, from->second.first));
+                    if (directory) {
+                        /* Everything under it has a new name, so rather than
+                         * renaming watches, start over */
+                        unwatch(from->second.first.string());
+                        if (!watch(path, NULL)) {
+                            fall_back();
+                        }
+                    }
+                    moved.erase(from);
+                }
+            }
+        }
+
+        /* Renames with no second half left the watched trees */
+        std::map<uint32_t, std::pair<Path, bool> >::iterator it;
+        for (it = moved.begin(); it != moved.end(); ++it) {
+            events.push_back(Event(Event::DELETED, it->second.first));
+            if (it->second.second) {
+                unwatch(it->second.first.string());
+            }
+        }
+#endif
+    }
+
+    inline void PathWatcher::coalesce(std::vector<Event>& events) {
+        /* The index of the most recent mergeable event for each path */
+        std::map<std::string, size_t> latest;
+        std::vector<bool> dropped(events.size(), false);
+        for (size_t i = 0; i < events.size(); ++i) {
+            Event& event(events[i]);
+            if (event.type == Event::MOVED) {
+                /* Don't merge anything across a rename */
+                latest.erase(event.from.string());
+                latest.erase(event.path.string());
+                continue;
+            } else if (event.type == Event::OVERFLOWED) {
+                continue;
+            }
+
+            std::map<std::string, size_t>::iterator it(
+                latest.find(event.path.string()));
+            if (it == latest.end()) {
+                latest[event.path.string()] = i;
+                continue;
+            }
+
+            Event& previous(events[it->second]);
+            if (previous.type == Event::CREATED) {
+                if (event.type == Event::DELETED) {
+                    /* It came and went */
+                    dropped[it->second] = true;
+                    latest.erase(it);
+                }
+                dropped[i] = true;
+            } else if (previous.type == Event::MODIFIED) {
+                if (event.type == Event::MODIFIED) {
+                    dropped[i] = true;
+                } else {
+                    dropped[it->second] = true;
+                    it->second = i;
+                }
+            } else if (previous.type == Event::DELETED) {
+                /* Replaced by something new */
+                if (event.type == Event::CREATED) {
+                    previous.type = Event::MODIFIED;
+                }
+                dropped[i] = true;
+            }
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (!dropped[i]) {
+                if (kept != i) {
+                    events[kept] = events[i];
+                }
+                ++kept;
+            }
+        }
+        events.erase(events.begin() + kept, events.end());
+    }
+}
+
+#endif